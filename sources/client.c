@@ -83,6 +83,7 @@ static int og_dbi_get_computer_info(struct og_computer *computer,
 
 static int og_resp_probe(struct og_client *cli, json_t *data)
 {
+	enum og_client_status cli_status;
 	const char *status = NULL;
 	const char *key;
 	json_t *value;
@@ -101,24 +102,32 @@ static int og_resp_probe(struct og_client *cli, json_t *data)
 		}
 	}
 
+	if (!status)
+		return -1;
+
 	if (!strcmp(status, "BSY"))
-		cli->status = OG_CLIENT_STATUS_BUSY;
+		cli_status = OG_CLIENT_STATUS_BUSY;
 	else if (!strcmp(status, "OPG"))
-		cli->status = OG_CLIENT_STATUS_OGLIVE;
+		cli_status = OG_CLIENT_STATUS_OGLIVE;
 	else if (!strcmp(status, "VRT"))
-		cli->status = OG_CLIENT_STATUS_VIRTUAL;
+		cli_status = OG_CLIENT_STATUS_VIRTUAL;
+	else
+		return 0;
+
+	if (cli->status != cli_status) {
+		cli->status = cli_status;
+		og_client_changed(cli);
+	}
 
-	return status ? 0 : -1;
+	return 0;
 }
 
 static int og_resp_shell_run(struct og_client *cli, json_t *data)
 {
 	const char *output = NULL;
-	char filename[4096];
 	const char *key;
 	json_t *value;
 	int err = -1;
-	FILE *file;
 
 	if (json_typeof(data) != JSON_OBJECT)
 		return -1;
@@ -139,18 +148,7 @@ static int og_resp_shell_run(struct og_client *cli, json_t *data)
 		return -1;
 	}
 
-	sprintf(filename, "/tmp/_Seconsola_%s", inet_ntoa(cli->addr.sin_addr));
-	file = fopen(filename, "wt");
-	if (!file) {
-		syslog(LOG_ERR, "cannot open file %s: %s\n",
-		       filename, strerror(errno));
-		return -1;
-	}
-
-	fprintf(file, "%s", output);
-	fclose(file);
-
-	return 0;
+	return og_client_shell_output(cli, output, strlen(output));
 }
 
 struct og_computer_legacy  {
@@ -617,8 +615,18 @@ static int og_resp_image_restore(json_t *data, struct og_client *cli)
 	return 0;
 }
 
+static void og_client_last_cmd_reset(struct og_client *cli)
+{
+	if (cli->last_cmd == OG_CMD_UNSPEC)
+		return;
+
+	cli->last_cmd = OG_CMD_UNSPEC;
+	og_client_changed(cli);
+}
+
 int og_agent_state_process_response(struct og_client *cli)
 {
+	struct og_arena arena = {};
 	json_error_t json_err;
 	json_t *root;
 	int err = -1;
@@ -640,17 +648,20 @@ int og_agent_state_process_response(struct og_client *cli)
 	cli->last_cmd_id = 0;
 
 	if (!cli->content_length) {
-		cli->last_cmd = OG_CMD_UNSPEC;
+		og_client_last_cmd_reset(cli);
 		return 0;
 	}
 
 	body = strstr(cli->buf, "\r\n\r\n") + 4;
 
+	/* The reply tree is released at once when the arena is freed. */
+	og_json_set_arena(&arena);
+
 	root = json_loads(body, 0, &json_err);
 	if (!root) {
 		syslog(LOG_ERR, "%s:%d: malformed json line %d: %s\n",
 		       __FILE__, __LINE__, json_err.line, json_err.text);
-		return -1;
+		goto out;
 	}
 
 	switch (cli->last_cmd) {
@@ -683,7 +694,10 @@ int og_agent_state_process_response(struct og_client *cli)
 		break;
 	}
 
-	cli->last_cmd = OG_CMD_UNSPEC;
+	og_client_last_cmd_reset(cli);
+out:
+	og_json_set_arena(NULL);
+	og_arena_free(&arena);
 
 	return err;
 }
@@ -32,7 +32,9 @@ static void og_client_release(struct ev_loop *loop, struct og_client *cli)
 		tbsockets[cli->keepalive_idx].cli = NULL;
 	}
 
-	list_del(&cli->list);
+	og_client_stream_free(cli);
+	og_client_del(cli);
+	og_client_changed(cli);
 	ev_io_stop(loop, &cli->io);
 	close(cli->io.fd);
 	free(cli);
@@ -69,8 +71,38 @@ static int og_client_payload_too_large(struct og_client *cli)
 	return -1;
 }
 
+/* Gzip is preferred over deflate, codings with a zero quality value are
+ * refused by the client.
+ */
+static enum og_encoding og_client_encoding(char *accept_encoding)
+{
+	enum og_encoding encoding = OG_ENCODING_IDENTITY;
+	char *token, *saveptr, *q;
+	size_t len;
+
+	for (token = strtok_r(accept_encoding, ",", &saveptr); token;
+	     token = strtok_r(NULL, ",", &saveptr)) {
+		token += strspn(token, " \t");
+		len = strcspn(token, " \t;");
+
+		q = strstr(token + len, "q=");
+		if (q && strtod(q + strlen("q="), NULL) <= 0.)
+			continue;
+
+		if (len == strlen("gzip") && !strncmp(token, "gzip", len))
+			encoding = OG_ENCODING_GZIP;
+		else if (len == strlen("deflate") &&
+			 !strncmp(token, "deflate", len) &&
+			 encoding == OG_ENCODING_IDENTITY)
+			encoding = OG_ENCODING_DEFLATE;
+	}
+
+	return encoding;
+}
+
 static int og_client_state_recv_hdr_rest(struct og_client *cli)
 {
+	char accept_encoding[128] = {};
 	char *ptr;
 
 	ptr = strstr(cli->buf, "\r\n\r\n");
@@ -91,6 +123,16 @@ static int og_client_state_recv_hdr_rest(struct og_client *cli)
 	if (ptr)
 		sscanf(ptr, "Authorization: %63[^\r\n]", cli->auth_token);
 
+	ptr = strstr(cli->buf, "If-None-Match: ");
+	if (ptr)
+		sscanf(ptr, "If-None-Match: %63[^\r\n]", cli->if_none_match);
+
+	ptr = strstr(cli->buf, "Accept-Encoding: ");
+	if (ptr) {
+		sscanf(ptr, "Accept-Encoding: %127[^\r\n]", accept_encoding);
+		cli->encoding = og_client_encoding(accept_encoding);
+	}
+
 	return 1;
 }
 
@@ -123,6 +165,64 @@ static int og_client_recv(struct og_client *cli, int events)
 	return ret;
 }
 
+/* Shut down connection if there is no complete message after 10 seconds. */
+#define OG_CLIENT_TIMEOUT       10
+
+static void og_client_write_cb(struct ev_loop *loop, struct ev_io *io, int events)
+{
+	struct og_client *cli;
+	int ret;
+
+	cli = container_of(io, struct og_client, io);
+
+	ret = og_client_stream_send(cli);
+	if (ret < 0) {
+		syslog(LOG_ERR, "error streaming reply to %s:%hu (%s)\n",
+		       inet_ntoa(cli->addr.sin_addr), ntohs(cli->addr.sin_port),
+		       strerror(errno));
+	} else if (ret > 1) {
+		/* Nothing to send until og_client_stream_wake() is called. */
+		ev_io_stop(loop, &cli->io);
+		ev_timer_stop(loop, &cli->timer);
+		return;
+	} else if (ret > 0) {
+		ev_timer_again(loop, &cli->timer);
+		return;
+	}
+
+	ev_timer_stop(loop, &cli->timer);
+	og_client_release(loop, cli);
+}
+
+/* The reply is streamed, wait for the socket to be writable instead of
+ * blocking until the whole reply is sent. The connection is closed once the
+ * last chunk is out, or if the client stops reading for 10 seconds.
+ */
+static void og_client_stream(struct ev_loop *loop, struct og_client *cli)
+{
+	int fd = og_client_socket(cli);
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	ev_io_stop(loop, &cli->io);
+	ev_io_set(&cli->io, fd, EV_WRITE);
+	ev_set_cb(&cli->io, og_client_write_cb);
+	ev_io_start(loop, &cli->io);
+
+	cli->timer.repeat = OG_CLIENT_TIMEOUT;
+	ev_timer_again(loop, &cli->timer);
+}
+
+/* Resume a streamed reply that was waiting for more data to be queued. */
+void og_client_stream_wake(struct og_client *cli)
+{
+	if (ev_is_active(&cli->io))
+		return;
+
+	ev_io_start(og_loop, &cli->io);
+	ev_timer_again(og_loop, &cli->timer);
+}
+
 static void og_client_read_cb(struct ev_loop *loop, struct ev_io *io, int events)
 {
 	struct og_client *cli;
@@ -174,6 +274,11 @@ static void og_client_read_cb(struct ev_loop *loop, struct ev_io *io, int events
 		if (ret < 0)
 			goto close;
 
+		if (ret > 0) {
+			og_client_stream(loop, cli);
+			return;
+		}
+
 		if (cli->keepalive_idx < 0) {
 			syslog(LOG_DEBUG, "server closing connection to %s:%hu\n",
 			       inet_ntoa(cli->addr.sin_addr), ntohs(cli->addr.sin_port));
@@ -235,11 +340,11 @@ static void og_agent_deliver_pending_cmd(struct og_client *cli)
 {
 	const struct og_cmd *cmd;
 
-	cmd = og_cmd_find(inet_ntoa(cli->addr.sin_addr));
+	cmd = og_cmd_find(cli->addr.sin_addr);
 	if (!cmd)
 		return;
 
-	og_send_request(cmd->method, cmd->type, &cmd->params, cmd->json);
+	og_cmd_send(cli, cmd);
 	cli->last_cmd_id = cmd->id;
 
 	og_cmd_free(cmd);
@@ -325,12 +430,13 @@ static void og_client_timer_cb(struct ev_loop *loop, ev_timer *timer, int events
 
 static void og_agent_send_refresh(struct og_client *cli)
 {
-	struct og_msg_params params;
+	const char *addr = inet_ntoa(cli->addr.sin_addr);
+	struct og_msg_params params = {
+		.ips_array	= &addr,
+		.ips_array_len	= 1,
+	};
 	int err;
 
-	params.ips_array[0] = inet_ntoa(cli->addr.sin_addr);
-	params.ips_array_len = 1;
-
 	err = og_send_request(OG_METHOD_GET, OG_CMD_REFRESH, &params, NULL);
 	if (err < 0) {
 		syslog(LOG_ERR, "Can't send refresh to: %s\n",
@@ -341,9 +447,6 @@ static void og_agent_send_refresh(struct og_client *cli)
 	}
 }
 
-/* Shut down connection if there is no complete message after 10 seconds. */
-#define OG_CLIENT_TIMEOUT       10
-
 /* Agent client operation might take longer, shut down after 30 seconds. */
 #define OG_AGENT_CLIENT_TIMEOUT 30
 
@@ -400,6 +503,9 @@ void og_server_accept_cb(struct ev_loop *loop, struct ev_io *io, int events)
 	ev_timer_start(loop, &cli->timer);
 	og_client_add(cli);
 
+	if (cli->agent)
+		og_wol_awake(cli->addr.sin_addr);
+
 	if (io->fd == socket_agent_rest) {
 		og_agent_send_refresh(cli);
 	}
@@ -8,6 +8,59 @@
 
 #include "json.h"
 #include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+
+/* While an arena is set, jansson allocates from it and releasing objects is a
+ * no-op, the whole tree goes away with og_arena_free(). Each allocation
+ * records where it comes from, objects that were created outside the arena
+ * are still released one by one.
+ */
+struct og_json_alloc {
+	struct og_arena	*arena;
+};
+
+static struct og_arena *og_json_arena;
+
+static void *og_json_malloc(size_t size)
+{
+	struct og_json_alloc *alloc;
+
+	if (og_json_arena)
+		alloc = og_arena_alloc(og_json_arena, sizeof(*alloc) + size);
+	else
+		alloc = malloc(sizeof(*alloc) + size);
+
+	if (!alloc)
+		return NULL;
+
+	alloc->arena = og_json_arena;
+
+	return alloc + 1;
+}
+
+static void og_json_free(void *ptr)
+{
+	struct og_json_alloc *alloc;
+
+	if (!ptr)
+		return;
+
+	alloc = (struct og_json_alloc *)ptr - 1;
+	if (!alloc->arena)
+		free(alloc);
+}
+
+void og_json_init(void)
+{
+	json_set_alloc_funcs(og_json_malloc, og_json_free);
+}
+
+/* JSON objects that are created while the arena is set must not outlive it. */
+void og_json_set_arena(struct og_arena *arena)
+{
+	og_json_arena = arena;
+}
 
 int og_json_parse_string(json_t *element, const char **str)
 {
@@ -39,47 +92,110 @@ int og_json_parse_bool(json_t *element, bool *value)
 	return 0;
 }
 
-int og_json_parse_partition(json_t *element, struct og_partition *part,
-			    uint64_t required_flags)
+static void og_json_params_init(struct og_json_params *params)
 {
-	uint64_t flags = 0UL;
+	const struct og_json_param *param;
+	unsigned int i;
+	uint32_t idx;
+
+	for (i = 0; i < params->len; i++) {
+		param = &params->param[i];
+		idx = og_hash(param->key, strlen(param->key));
+		while (params->hash[idx % OG_JSON_PARAMS_HASH_SIZE])
+			idx++;
+		params->hash[idx % OG_JSON_PARAMS_HASH_SIZE] = param;
+	}
+	params->ready = true;
+}
+
+static const struct og_json_param *og_json_params_find(const struct og_json_params *params,
+							const char *key)
+{
+	const struct og_json_param *param;
+	uint32_t idx;
+
+	idx = og_hash(key, strlen(key));
+	while ((param = params->hash[idx % OG_JSON_PARAMS_HASH_SIZE])) {
+		if (!strcmp(param->key, key))
+			return param;
+		idx++;
+	}
+
+	return NULL;
+}
+
+/* Decode the keys of element whose flag is in mask, other keys are skipped.
+ * Returns the number of keys that have been decoded or -1 on error.
+ */
+int og_json_parse_params(json_t *element, struct og_json_params *params,
+			 void *base, uint64_t *flags, uint64_t mask)
+{
+	const struct og_json_param *param;
 	const char *key;
 	json_t *value;
-	int err = 0;
+	int err, n = 0;
+	void *field;
+
+	if (json_typeof(element) != JSON_OBJECT)
+		return -1;
+
+	if (!params->ready)
+		og_json_params_init(params);
 
 	json_object_foreach(element, key, value) {
-		if (!strcmp(key, "partition")) {
-			err = og_json_parse_string(value, &part->number);
-			flags |= OG_PARAM_PART_NUMBER;
-		} else if (!strcmp(key, "code")) {
-			err = og_json_parse_string(value, &part->code);
-			flags |= OG_PARAM_PART_CODE;
-		} else if (!strcmp(key, "filesystem")) {
-			err = og_json_parse_string(value, &part->filesystem);
-			flags |= OG_PARAM_PART_FILESYSTEM;
-		} else if (!strcmp(key, "size")) {
-			err = og_json_parse_string(value, &part->size);
-			flags |= OG_PARAM_PART_SIZE;
-		} else if (!strcmp(key, "format")) {
-			err = og_json_parse_string(value, &part->format);
-			flags |= OG_PARAM_PART_FORMAT;
-		} else if (!strcmp(key, "disk")) {
-			err = og_json_parse_string(value, &part->disk);
-			flags |= OG_PARAM_PART_DISK;
-		} else if (!strcmp(key, "os")) {
-			err = og_json_parse_string(value, &part->os);
-			flags |= OG_PARAM_PART_OS;
-		} else if (!strcmp(key, "used_size")) {
-			err = og_json_parse_string(value, &part->used_size);
-			flags |= OG_PARAM_PART_USED_SIZE;
-		}
+		param = og_json_params_find(params, key);
+		if (!param || !(param->flag & mask))
+			continue;
 
+		field = (char *)base + param->offset;
+		switch (param->type) {
+		case OG_JSON_PARAM_STRING:
+			err = og_json_parse_string(value, field);
+			break;
+		case OG_JSON_PARAM_UINT:
+			err = og_json_parse_uint(value, field);
+			break;
+		case OG_JSON_PARAM_BOOL:
+			err = og_json_parse_bool(value, field);
+			break;
+		case OG_JSON_PARAM_FUNC:
+			err = param->parse(value, base);
+			break;
+		default:
+			err = -1;
+			break;
+		}
 		if (err < 0)
 			return err;
+
+		if (param->type != OG_JSON_PARAM_FUNC)
+			*flags |= param->flag;
+		n++;
 	}
 
+	return n;
+}
+
+static const struct og_json_param og_partition_param[] = {
+#define X(...)	OG_JSON_PARAM(struct og_partition, __VA_ARGS__)
+	OG_PARTITION_PARAMS(X)
+#undef X
+};
+
+static struct og_json_params og_partition_params =
+	OG_JSON_PARAMS_INIT(og_partition_param);
+
+int og_json_parse_partition(json_t *element, struct og_partition *part,
+			    uint64_t required_flags)
+{
+	uint64_t flags = 0UL;
+
+	if (og_json_parse_params(element, &og_partition_params, part, &flags,
+				 0 OG_PARTITION_PARAMS(OG_JSON_PARAM_FLAG)) < 0)
+		return -1;
+
 	if (flags != required_flags)
 		return -1;
 
-	return err;
+	return 0;
 }
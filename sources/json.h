@@ -2,12 +2,65 @@
 #define _OG_JSON_H
 
 #include <jansson.h>
+#include <stddef.h>
 #include "schedule.h"
+#include "utils.h"
+
+void og_json_init(void);
+void og_json_set_arena(struct og_arena *arena);
 
 int og_json_parse_string(json_t *element, const char **str);
 int og_json_parse_uint(json_t *element, uint32_t *integer);
 int og_json_parse_bool(json_t *element, bool *value);
 
+enum og_json_param_type {
+	OG_JSON_PARAM_STRING,
+	OG_JSON_PARAM_UINT,
+	OG_JSON_PARAM_BOOL,
+	OG_JSON_PARAM_FUNC,
+};
+
+/* Decodes the value of key into the field at offset of the target structure
+ * and sets flag. Custom parsers get the target structure and set the flags by
+ * themselves, nested objects usually set one flag per key.
+ */
+struct og_json_param {
+	const char		*key;
+	enum og_json_param_type	type;
+	size_t			offset;
+	uint64_t		flag;
+	int			(*parse)(json_t *element, void *base);
+};
+
+#define OG_JSON_PARAMS_HASH_SIZE	64
+
+struct og_json_params {
+	const struct og_json_param	*param;
+	unsigned int			len;
+	const struct og_json_param	*hash[OG_JSON_PARAMS_HASH_SIZE];
+	bool				ready;
+};
+
+#define OG_JSON_PARAM(_base, _key, _type, _field, _flag, _parse)	\
+	{								\
+		.key	= _key,						\
+		.type	= OG_JSON_PARAM_##_type,			\
+		.offset	= offsetof(_base, _field),			\
+		.flag	= _flag,					\
+		.parse	= _parse,					\
+	},
+
+#define OG_JSON_PARAM_FLAG(_key, _type, _field, _flag, _parse)	| (_flag)
+
+#define OG_JSON_PARAMS_INIT(_param)					\
+	{								\
+		.param	= _param,					\
+		.len	= sizeof(_param) / sizeof(_param[0]),		\
+	}
+
+int og_json_parse_params(json_t *element, struct og_json_params *params,
+			 void *base, uint64_t *flags, uint64_t mask);
+
 #define OG_PARAM_PART_NUMBER			(1UL << 0)
 #define OG_PARAM_PART_CODE			(1UL << 1)
 #define OG_PARAM_PART_FILESYSTEM		(1UL << 2)
@@ -17,6 +70,17 @@ int og_json_parse_bool(json_t *element, bool *value);
 #define OG_PARAM_PART_OS			(1UL << 6)
 #define OG_PARAM_PART_USED_SIZE			(1UL << 7)
 
+/*	key		type	field		flag				parser */
+#define OG_PARTITION_PARAMS(X)							\
+	X("partition",	STRING,	number,		OG_PARAM_PART_NUMBER,		NULL)	\
+	X("code",	STRING,	code,		OG_PARAM_PART_CODE,		NULL)	\
+	X("filesystem",	STRING,	filesystem,	OG_PARAM_PART_FILESYSTEM,	NULL)	\
+	X("size",	STRING,	size,		OG_PARAM_PART_SIZE,		NULL)	\
+	X("format",	STRING,	format,		OG_PARAM_PART_FORMAT,		NULL)	\
+	X("disk",	STRING,	disk,		OG_PARAM_PART_DISK,		NULL)	\
+	X("os",		STRING,	os,		OG_PARAM_PART_OS,		NULL)	\
+	X("used_size",	STRING,	used_size,	OG_PARAM_PART_USED_SIZE,	NULL)
+
 struct og_partition {
 	const char	*disk;
 	const char	*number;
@@ -33,8 +97,6 @@ struct og_partition {
 int og_json_parse_partition(json_t *element, struct og_partition *part,
 			    uint64_t required_flags);
 
-#define OG_CLIENTS_MAX	4096
-
 struct og_sync_params {
 	const char	*sync;
 	const char	*diff;
@@ -51,9 +113,14 @@ struct og_sync_params {
 };
 
 struct og_msg_params {
-	const char	*ips_array[OG_CLIENTS_MAX];
-	const char	*mac_array[OG_CLIENTS_MAX];
+	struct og_arena	*arena;
+	const char	**ips_array;
+	const char	**mac_array;
 	unsigned int	ips_array_len;
+	const char	*payload;
+	unsigned int	payload_len;
+	const char	*query;
+	unsigned int	query_len;
 	const char	*wol_type;
 	char		run_cmd[4096];
 	const char	*disk;
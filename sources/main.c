@@ -15,6 +15,7 @@
 #include "json.h"
 #include "schedule.h"
 #include "core.h"
+#include "wol.h"
 #include <syslog.h>
 
 int main(int argc, char *argv[])
@@ -22,6 +23,7 @@ int main(int argc, char *argv[])
 	struct ev_io ev_io_server_rest, ev_io_agent_rest;
 	int i;
 
+	og_json_init();
 	og_loop = ev_default_loop(0);
 
 	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
@@ -36,6 +38,9 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
+	if (og_wol_init(og_loop, interface) < 0)
+		exit(EXIT_FAILURE);
+
 	for (i = 0; i < MAXIMOS_CLIENTES; i++) {
 		tbsockets[i].ip[0] = '\0';
 		tbsockets[i].cli = NULL;
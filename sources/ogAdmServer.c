@@ -14,6 +14,7 @@
 #include "client.h"
 #include "json.h"
 #include "schedule.h"
+#include "wol.h"
 #include <syslog.h>
 #include <sys/ioctl.h>
 #include <ifaddrs.h>
@@ -27,7 +28,7 @@ static char usuario[LONPRM]; // Usuario de acceso a la base de datos
 static char pasguor[LONPRM]; // Password del usuario
 static char datasource[LONPRM]; // Dirección IP del gestor de base de datos
 static char catalog[LONPRM]; // Nombre de la base de datos
-static char interface[LONPRM]; // Interface name
+char interface[LONPRM]; // Interface name
 char auth_token[LONPRM]; // API token
 
 struct og_dbi_config dbi_config = {
@@ -93,6 +94,31 @@ bool tomaConfiguracion(const char *filecfg)
 			snprintf(interface, sizeof(interface), "%s", value);
 		else if (!strcmp(str_toupper(key), "APITOKEN"))
 			snprintf(auth_token, sizeof(auth_token), "%s", value);
+		else if (!strcmp(str_toupper(key), "WOLWAVESIZE")) {
+			if (!value || atoi(value) < 1)
+				syslog(LOG_ERR, "WOLWAVESIZE must be at least 1, using %u\n",
+				       og_wol_config.wave_size);
+			else
+				og_wol_config.wave_size = atoi(value);
+		} else if (!strcmp(str_toupper(key), "WOLWAVEINTERVAL")) {
+			if (!value || !(atof(value) > 0.))
+				syslog(LOG_ERR, "WOLWAVEINTERVAL must be positive, using %.2f\n",
+				       og_wol_config.wave_interval);
+			else
+				og_wol_config.wave_interval = atof(value);
+		} else if (!strcmp(str_toupper(key), "WOLTIMEOUT")) {
+			if (!value || !(atof(value) > 0.))
+				syslog(LOG_ERR, "WOLTIMEOUT must be positive, using %.2f\n",
+				       og_wol_config.timeout);
+			else
+				og_wol_config.timeout = atof(value);
+		} else if (!strcmp(str_toupper(key), "WOLRETRIES")) {
+			if (!value || atoi(value) < 0)
+				syslog(LOG_ERR, "WOLRETRIES cannot be negative, using %u\n",
+				       og_wol_config.retries);
+			else
+				og_wol_config.retries = atoi(value);
+		}
 
 		line = fgets(buf, sizeof(buf), fcfg);
 	}
@@ -429,186 +455,6 @@ int checkDato(struct og_dbi *dbi, char *dato, const char *tabla,
 	return (identificador);
 }
 
-// ________________________________________________________________________________________________________
-// Función: Levanta
-//
-//	Descripción:
-//		Enciende ordenadores a través de la red cuyas macs se pasan como parámetro
-//	Parámetros:
-//		- iph: Cadena de direcciones ip separadas por ";"
-//		- mac: Cadena de direcciones mac separadas por ";"
-//		- mar: Método de arranque (1=Broadcast, 2=Unicast)
-//	Devuelve:
-//		true: Si el proceso es correcto
-//		false: En caso de ocurrir algún error
-// ________________________________________________________________________________________________________
-
-bool Levanta(char *ptrIP[], char *ptrMacs[], int lon, char *mar)
-{
-	unsigned int on = 1;
-	struct sockaddr_in local;
-	int i, res;
-	int s;
-
-	/* Creación de socket para envío de magig packet */
-	s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-	if (s < 0) {
-		syslog(LOG_ERR, "cannot create socket for magic packet\n");
-		return false;
-	}
-	res = setsockopt(s, SOL_SOCKET, SO_BROADCAST, (unsigned int *) &on,
-			 sizeof(on));
-	if (res < 0) {
-		syslog(LOG_ERR, "cannot set broadcast socket\n");
-		return false;
-	}
-	memset(&local, 0, sizeof(local));
-	local.sin_family = AF_INET;
-	local.sin_port = htons(PUERTO_WAKEUP);
-	local.sin_addr.s_addr = htonl(INADDR_ANY);
-
-	for (i = 0; i < lon; i++) {
-		if (!WakeUp(s, ptrIP[i], ptrMacs[i], mar)) {
-			syslog(LOG_ERR, "problem sending magic packet\n");
-			close(s);
-			return false;
-		}
-	}
-	close(s);
-	return true;
-}
-
-#define OG_WOL_SEQUENCE		6
-#define OG_WOL_MACADDR_LEN	6
-#define OG_WOL_REPEAT		16
-
-struct wol_msg {
-	char secuencia_FF[OG_WOL_SEQUENCE];
-	char macbin[OG_WOL_REPEAT][OG_WOL_MACADDR_LEN];
-};
-
-static bool wake_up_broadcast(int sd, struct sockaddr_in *client,
-			      const struct wol_msg *msg)
-{
-	struct sockaddr_in *broadcast_addr;
-	struct ifaddrs *ifaddr, *ifa;
-	int ret;
-
-	if (getifaddrs(&ifaddr) < 0) {
-		syslog(LOG_ERR, "cannot get list of addresses\n");
-		return false;
-	}
-
-	client->sin_addr.s_addr = htonl(INADDR_BROADCAST);
-
-	for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
-		if (ifa->ifa_addr == NULL ||
-		    ifa->ifa_addr->sa_family != AF_INET ||
-		    strcmp(ifa->ifa_name, interface) != 0)
-			continue;
-
-		broadcast_addr =
-			(struct sockaddr_in *)ifa->ifa_ifu.ifu_broadaddr;
-		client->sin_addr.s_addr = broadcast_addr->sin_addr.s_addr;
-		break;
-	}
-	freeifaddrs(ifaddr);
-
-	ret = sendto(sd, msg, sizeof(*msg), 0,
-		     (struct sockaddr *)client, sizeof(*client));
-	if (ret < 0) {
-		syslog(LOG_ERR, "failed to send broadcast wol\n");
-		return false;
-	}
-
-	return true;
-}
-
-static bool wake_up_unicast(int sd, struct sockaddr_in *client,
-			    const struct wol_msg *msg,
-			    const struct in_addr *addr)
-{
-	int ret;
-
-	client->sin_addr.s_addr = addr->s_addr;
-
-	ret = sendto(sd, msg, sizeof(*msg), 0,
-		     (struct sockaddr *)client, sizeof(*client));
-	if (ret < 0) {
-		syslog(LOG_ERR, "failed to send unicast wol\n");
-		return false;
-	}
-
-	return true;
-}
-
-enum wol_delivery_type {
-	OG_WOL_BROADCAST = 1,
-	OG_WOL_UNICAST = 2
-};
-
-//_____________________________________________________________________________________________________________
-// Función: WakeUp
-//
-//	 Descripción:
-//		Enciende el ordenador cuya MAC se pasa como parámetro
-//	Parámetros:
-//		- s : Socket para enviar trama magic packet
-//		- iph : Cadena con la dirección ip
-//		- mac : Cadena con la dirección mac en formato XXXXXXXXXXXX
-//		- mar: Método de arranque (1=Broadcast, 2=Unicast)
-//	Devuelve:
-//		true: Si el proceso es correcto
-//		false: En caso de ocurrir algún error
-//_____________________________________________________________________________________________________________
-//
-bool WakeUp(int s, char* iph, char *mac, char *mar)
-{
-	unsigned int macaddr[OG_WOL_MACADDR_LEN];
-	char HDaddress_bin[OG_WOL_MACADDR_LEN];
-	struct sockaddr_in WakeUpCliente;
-	struct wol_msg Trama_WakeUp;
-	struct in_addr addr;
-	bool ret;
-	int i;
-
-	for (i = 0; i < 6; i++) // Primera secuencia de la trama Wake Up (0xFFFFFFFFFFFF)
-		Trama_WakeUp.secuencia_FF[i] = 0xFF;
-
-	sscanf(mac, "%02x%02x%02x%02x%02x%02x",
-	       &macaddr[0], &macaddr[1], &macaddr[2],
-	       &macaddr[3], &macaddr[4], &macaddr[5]);
-
-	for (i = 0; i < 6; i++)
-		HDaddress_bin[i] = (uint8_t)macaddr[i];
-
-	for (i = 0; i < 16; i++) // Segunda secuencia de la trama Wake Up , repetir 16 veces su la MAC
-		memcpy(&Trama_WakeUp.macbin[i][0], &HDaddress_bin, 6);
-
-	/* Creación de socket del cliente que recibe la trama magic packet */
-	WakeUpCliente.sin_family = AF_INET;
-	WakeUpCliente.sin_port = htons((short) PUERTO_WAKEUP);
-
-	switch (atoi(mar)) {
-	case OG_WOL_BROADCAST:
-		ret = wake_up_broadcast(s, &WakeUpCliente, &Trama_WakeUp);
-		break;
-	case OG_WOL_UNICAST:
-		if (inet_aton(iph, &addr) < 0) {
-			syslog(LOG_ERR, "bad IP address for unicast wol\n");
-			ret = false;
-			break;
-		}
-		ret = wake_up_unicast(s, &WakeUpCliente, &Trama_WakeUp, &addr);
-		break;
-	default:
-		syslog(LOG_ERR, "unknown wol type\n");
-		ret = false;
-		break;
-	}
-	return ret;
-}
-
 // ________________________________________________________________________________________________________
 // Función: actualizaCreacionImagen
 //
@@ -24,6 +24,7 @@
 // ________________________________________________________________________________________________________
 char servidoradm[LONPRM];	// Dirección IP del servidor de administración
 char puerto[LONPRM];	// Puerto de comunicación
+extern char interface[LONPRM]; // Interface name
 
 struct og_client;
 
@@ -39,8 +40,6 @@ struct og_dbi;
 bool clienteExistente(char *,int *);
 bool clienteDisponible(char *,int *);
 bool actualizaConfiguracion(struct og_dbi *,char* ,int);
-bool Levanta(char**, char**, int, char*);
-bool WakeUp(int,char*,char*,char*);
 bool actualizaCreacionImagen(struct og_dbi *,char*,char*,char*,char*,char*,char*);
 bool actualizaRestauracionImagen(struct og_dbi *,char*,char*,char*,char*,char*);
 bool actualizaHardware(struct og_dbi *dbi, char* ,char*,char*,char*);
@@ -12,14 +12,18 @@
 #include "list.h"
 #include "rest.h"
 #include "schedule.h"
+#include "scope.h"
 #include <ev.h>
 #include <syslog.h>
 #include <sys/ioctl.h>
 #include <ifaddrs.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <jansson.h>
+#include <stdarg.h>
+#include <zlib.h>
 #include <time.h>
 
 struct ev_loop *og_loop;
@@ -107,375 +111,1860 @@ static bool og_send_cmd(char *ips_array[], int ips_array_len,
 #define OG_REST_PARAM_TIME_HOURS		(1UL << 37)
 #define OG_REST_PARAM_TIME_AM_PM		(1UL << 38)
 #define OG_REST_PARAM_TIME_MINUTES		(1UL << 39)
+#define OG_REST_PARAM_SCOPE			(1UL << 40)
+#define OG_REST_PARAM_SCOPE_TYPE		(1UL << 41)
+#define OG_REST_PARAM_SCOPE_ID			(1UL << 42)
+#define OG_REST_PARAM_PART_ALL			(OG_REST_PARAM_PART_0 |	\
+						 OG_REST_PARAM_PART_1 |	\
+						 OG_REST_PARAM_PART_2 |	\
+						 OG_REST_PARAM_PART_3)
+
+/*	key		type	field		flag					parser */
+#define OG_REST_SYNC_PARAMS(X)								\
+	X("sync",	STRING,	sync,		OG_REST_PARAM_SYNC_SYNC,		NULL)	\
+	X("diff",	STRING,	diff,		OG_REST_PARAM_SYNC_DIFF,		NULL)	\
+	X("remove",	STRING,	remove,		OG_REST_PARAM_SYNC_REMOVE,		NULL)	\
+	X("compress",	STRING,	compress,	OG_REST_PARAM_SYNC_COMPRESS,		NULL)	\
+	X("cleanup",	STRING,	cleanup,	OG_REST_PARAM_SYNC_CLEANUP,		NULL)	\
+	X("cache",	STRING,	cache,		OG_REST_PARAM_SYNC_CACHE,		NULL)	\
+	X("cleanup_cache", STRING, cleanup_cache, OG_REST_PARAM_SYNC_CLEANUP_CACHE,	NULL)	\
+	X("remove_dst",	STRING,	remove_dst,	OG_REST_PARAM_SYNC_REMOVE_DST,		NULL)	\
+	X("diff_id",	STRING,	diff_id,	OG_REST_PARAM_SYNC_DIFF_ID,		NULL)	\
+	X("diff_name",	STRING,	diff_name,	OG_REST_PARAM_SYNC_DIFF_NAME,		NULL)	\
+	X("path",	STRING,	path,		OG_REST_PARAM_SYNC_PATH,		NULL)	\
+	X("method",	STRING,	method,		OG_REST_PARAM_SYNC_METHOD,		NULL)
+
+#define OG_REST_PARAM_SYNC_ALL	(0 OG_REST_SYNC_PARAMS(OG_JSON_PARAM_FLAG))
+
+static const struct og_json_param og_rest_sync_param[] = {
+#define X(...)	OG_JSON_PARAM(struct og_sync_params, __VA_ARGS__)
+	OG_REST_SYNC_PARAMS(X)
+#undef X
+};
+
+static struct og_json_params og_rest_sync_params =
+	OG_JSON_PARAMS_INIT(og_rest_sync_param);
+
+/*	key		type	field		flag				parser */
+#define OG_REST_TIME_PARAMS(X)							\
+	X("years",	UINT,	years,		OG_REST_PARAM_TIME_YEARS,	NULL)	\
+	X("months",	UINT,	months,		OG_REST_PARAM_TIME_MONTHS,	NULL)	\
+	X("weeks",	UINT,	weeks,		OG_REST_PARAM_TIME_WEEKS,	NULL)	\
+	X("week_days",	UINT,	week_days,	OG_REST_PARAM_TIME_WEEK_DAYS,	NULL)	\
+	X("days",	UINT,	days,		OG_REST_PARAM_TIME_DAYS,	NULL)	\
+	X("hours",	UINT,	hours,		OG_REST_PARAM_TIME_HOURS,	NULL)	\
+	X("am_pm",	UINT,	am_pm,		OG_REST_PARAM_TIME_AM_PM,	NULL)	\
+	X("minutes",	UINT,	minutes,	OG_REST_PARAM_TIME_MINUTES,	NULL)
+
+#define OG_REST_PARAM_TIME_ALL	(0 OG_REST_TIME_PARAMS(OG_JSON_PARAM_FLAG))
+
+static const struct og_json_param og_rest_time_param[] = {
+#define X(...)	OG_JSON_PARAM(struct og_schedule_time, __VA_ARGS__)
+	OG_REST_TIME_PARAMS(X)
+#undef X
+};
+
+static struct og_json_params og_rest_time_params =
+	OG_JSON_PARAMS_INIT(og_rest_time_param);
+
+static LIST_HEAD(client_list);
+
+/* Agents indexed by IP address, each one keeps its own queue of pending
+ * commands, even if the agent is not connected yet, and the output of the last
+ * shell command that it has run. Agents are also kept in the order of their
+ * last change, seq is the client registry version at that time.
+ */
+struct og_agent {
+	struct list_head	hash_list;
+	struct list_head	seq_list;
+	struct list_head	tombstone_list;
+	uint32_t		seq;
+	struct in_addr		addr;
+	struct og_client	*cli;
+	struct list_head	cmd_list;
+	char			*output;
+	size_t			output_len;
+	uint32_t		output_seq;
+};
+
+/* Shell output is bounded by the largest reply an agent can send. */
+#define OG_SHELL_OUTPUT_MAXLEN	OG_MSG_REQUEST_MAXLEN
+
+static uint32_t og_shell_output_seq;
+
+#define OG_AGENT_HASH_SIZE	4096
+
+static struct list_head agent_hash[OG_AGENT_HASH_SIZE];
+
+/* Agents that go away stay in the change list as tombstones, so pollers learn
+ * about them too. Once there are too many, the oldest are dropped and pollers
+ * asking for changes before the last one dropped get the full list.
+ */
+#define OG_AGENT_TOMBSTONE_MAX	16384
+
+static LIST_HEAD(agent_seq_list);
+static LIST_HEAD(agent_tombstone_list);
+static unsigned int og_agent_seq_len;
+static unsigned int og_agent_tombstones;
+static uint32_t og_agent_seq_floor;
+
+static struct list_head *og_agent_hash_bucket(struct in_addr addr)
+{
+	struct list_head *bucket;
+
+	bucket = &agent_hash[og_hash(&addr, sizeof(addr)) % OG_AGENT_HASH_SIZE];
+	if (!bucket->next)
+		INIT_LIST_HEAD(bucket);
+
+	return bucket;
+}
+
+static struct og_agent *og_agent_lookup(struct in_addr addr, bool create)
+{
+	struct list_head *bucket = og_agent_hash_bucket(addr);
+	struct og_agent *agent;
+
+	list_for_each_entry(agent, bucket, hash_list) {
+		if (agent->addr.s_addr == addr.s_addr)
+			return agent;
+	}
+
+	if (!create)
+		return NULL;
+
+	agent = calloc(1, sizeof(struct og_agent));
+	if (!agent)
+		return NULL;
+
+	agent->addr = addr;
+	INIT_LIST_HEAD(&agent->seq_list);
+	INIT_LIST_HEAD(&agent->tombstone_list);
+	INIT_LIST_HEAD(&agent->cmd_list);
+	list_add(&agent->hash_list, bucket);
+
+	return agent;
+}
+
+/* Release this agent once it is not connected and has nothing pending. */
+static void og_agent_put(struct og_agent *agent)
+{
+	if (agent->cli || !list_empty(&agent->cmd_list) || agent->output ||
+	    !list_empty(&agent->seq_list))
+		return;
+
+	list_del(&agent->hash_list);
+	free(agent);
+}
+
+/* Tombstones keep the order of their last change, since agents that are gone
+ * do not change until they connect again.
+ */
+static void og_agent_tombstone_update(struct og_agent *agent)
+{
+	if (agent->cli) {
+		if (!list_empty(&agent->tombstone_list)) {
+			list_del_init(&agent->tombstone_list);
+			og_agent_tombstones--;
+		}
+		return;
+	}
+
+	if (list_empty(&agent->tombstone_list))
+		og_agent_tombstones++;
+	else
+		list_del(&agent->tombstone_list);
+	list_add_tail(&agent->tombstone_list, &agent_tombstone_list);
+
+	while (og_agent_tombstones > OG_AGENT_TOMBSTONE_MAX) {
+		agent = list_first_entry(&agent_tombstone_list,
+					 struct og_agent, tombstone_list);
+		list_del_init(&agent->tombstone_list);
+		og_agent_tombstones--;
+
+		list_del_init(&agent->seq_list);
+		og_agent_seq_len--;
+		og_agent_seq_floor = agent->seq;
+		og_agent_put(agent);
+	}
+}
+
+uint32_t og_client_version;
+
+static void og_events_client(struct in_addr addr);
+
+void og_client_changed(struct og_client *cli)
+{
+	struct og_agent *agent;
+
+	if (!cli->agent)
+		return;
+
+	og_client_version++;
+
+	agent = og_agent_lookup(cli->addr.sin_addr, true);
+	if (agent) {
+		if (list_empty(&agent->seq_list))
+			og_agent_seq_len++;
+		else
+			list_del(&agent->seq_list);
+
+		agent->seq = og_client_version;
+		list_add_tail(&agent->seq_list, &agent_seq_list);
+		og_agent_tombstone_update(agent);
+	}
+
+	og_events_client(cli->addr.sin_addr);
+}
+
+void og_client_add(struct og_client *cli)
+{
+	struct og_agent *agent;
+
+	list_add(&cli->list, &client_list);
+
+	if (!cli->agent)
+		return;
+
+	agent = og_agent_lookup(cli->addr.sin_addr, true);
+	if (!agent) {
+		syslog(LOG_ERR, "OOM while adding agent %s\n",
+		       inet_ntoa(cli->addr.sin_addr));
+		return;
+	}
+	agent->cli = cli;
+	og_client_changed(cli);
+}
+
+static void og_stream_client_del(struct og_client *cli);
+
+void og_client_del(struct og_client *cli)
+{
+	struct og_client *client;
+	struct og_agent *agent;
+
+	og_stream_client_del(cli);
+	list_del(&cli->list);
+
+	if (!cli->agent)
+		return;
+
+	agent = og_agent_lookup(cli->addr.sin_addr, false);
+	if (!agent || agent->cli != cli)
+		return;
+
+	/* Fall back to another connection from this agent, if any. */
+	agent->cli = NULL;
+	list_for_each_entry(client, &client_list, list) {
+		if (client->agent &&
+		    client->addr.sin_addr.s_addr == agent->addr.s_addr) {
+			agent->cli = client;
+			break;
+		}
+	}
+	og_agent_put(agent);
+}
+
+/* Replace the shell output of this agent, every update gets a new sequence
+ * number so pollers can tell fresh output from the one they already have.
+ */
+static int og_agent_output_set(struct og_agent *agent, const char *data,
+			       size_t len)
+{
+	char *output = NULL;
+
+	if (len > OG_SHELL_OUTPUT_MAXLEN)
+		len = OG_SHELL_OUTPUT_MAXLEN;
+
+	if (len) {
+		output = malloc(len + 1);
+		if (!output)
+			return -1;
+
+		memcpy(output, data, len);
+		output[len] = '\0';
+	}
+
+	free(agent->output);
+	agent->output = output;
+	agent->output_len = len;
+	agent->output_seq = ++og_shell_output_seq;
+
+	return 0;
+}
+
+int og_client_shell_output(struct og_client *cli, const char *data, size_t len)
+{
+	struct og_agent *agent;
+
+	agent = og_agent_lookup(cli->addr.sin_addr, true);
+	if (!agent)
+		return -1;
+
+	return og_agent_output_set(agent, data, len);
+}
+
+static struct og_client *og_client_find_addr(struct in_addr addr)
+{
+	struct og_agent *agent;
+
+	agent = og_agent_lookup(addr, false);
+	if (!agent)
+		return NULL;
+
+	return agent->cli;
+}
+
+static struct og_client *og_client_find(const char *ip)
+{
+	struct in_addr addr;
+	int res;
+
+	res = inet_aton(ip, &addr);
+	if (!res) {
+		syslog(LOG_ERR, "Invalid IP string: %s\n", ip);
+		return NULL;
+	}
+
+	return og_client_find_addr(addr);
+}
+
+static const char *og_client_status(const struct og_client *cli)
+{
+	if (cli->last_cmd != OG_CMD_UNSPEC)
+		return "BSY";
+
+	switch (cli->status) {
+	case OG_CLIENT_STATUS_BUSY:
+		return "BSY";
+	case OG_CLIENT_STATUS_OGLIVE:
+		return "OPG";
+	case OG_CLIENT_STATUS_VIRTUAL:
+		return "VRT";
+	default:
+		return "OFF";
+	}
+}
+
+static bool og_msg_params_validate(const struct og_msg_params *params,
+				   const uint64_t flags)
+{
+	return (params->flags & flags) == flags;
+}
+
+/* Make room for len more targets, arrays are allocated from the request arena
+ * so the old ones are simply left behind.
+ */
+static int og_msg_params_grow(struct og_msg_params *params, unsigned int len)
+{
+	unsigned int size = params->ips_array_len + len;
+	const char **ips_array, **mac_array;
+
+	ips_array = og_arena_zalloc(params->arena, size * sizeof(char *));
+	mac_array = og_arena_zalloc(params->arena, size * sizeof(char *));
+	if (!ips_array || !mac_array)
+		return -1;
+
+	if (params->ips_array_len) {
+		memcpy(ips_array, params->ips_array,
+		       params->ips_array_len * sizeof(char *));
+		memcpy(mac_array, params->mac_array,
+		       params->ips_array_len * sizeof(char *));
+	}
+	params->ips_array = ips_array;
+	params->mac_array = mac_array;
+
+	return 0;
+}
+
+static int og_json_parse_clients(json_t *element, void *base)
+{
+	struct og_msg_params *params = base;
+	unsigned int i;
+	json_t *k;
+
+	if (json_typeof(element) != JSON_ARRAY)
+		return -1;
+
+	if (og_msg_params_grow(params, json_array_size(element)) < 0)
+		return -1;
+
+	for (i = 0; i < json_array_size(element); i++) {
+		k = json_array_get(element, i);
+		if (json_typeof(k) != JSON_STRING)
+			return -1;
+
+		params->ips_array[params->ips_array_len++] =
+			json_string_value(k);
+
+		params->flags |= OG_REST_PARAM_ADDR;
+	}
+
+	return 0;
+}
+
+static const char *og_json_skip_space(const char *ptr)
+{
+	while (*ptr == ' ' || *ptr == '\t' || *ptr == '\r' || *ptr == '\n')
+		ptr++;
+
+	return ptr;
+}
+
+/* Returns the position after the closing quote of the string at ptr. */
+static const char *og_json_skip_string(const char *ptr)
+{
+	for (ptr++; *ptr && *ptr != '"'; ptr++) {
+		if (*ptr == '\\' && !*++ptr)
+			return NULL;
+	}
+
+	return *ptr ? ptr + 1 : NULL;
+}
+
+/* Returns the position of the comma or the closing bracket that follows the
+ * value at ptr. Nested values are skipped by counting brackets, the JSON parser
+ * is in charge of validating them.
+ */
+static const char *og_json_skip_value(const char *ptr)
+{
+	unsigned int depth = 0;
+
+	while (*ptr) {
+		switch (*ptr) {
+		case '"':
+			ptr = og_json_skip_string(ptr);
+			if (!ptr)
+				return NULL;
+			continue;
+		case '{':
+		case '[':
+			depth++;
+			break;
+		case '}':
+		case ']':
+			if (!depth)
+				return ptr;
+			depth--;
+			break;
+		case ',':
+			if (!depth)
+				return ptr;
+			break;
+		}
+		ptr++;
+	}
+
+	return NULL;
+}
+
+/* Scan the array of strings at ptr and return the position after its closing
+ * bracket, or NULL if this is not a plain array of strings. Addresses are only
+ * counted in len unless params is set, then they are also copied to it.
+ */
+static const char *og_json_scan_clients(const char *ptr,
+					struct og_msg_params *params,
+					unsigned int *len)
+{
+	const char *end;
+	char *addr;
+
+	*len = 0;
+	ptr = og_json_skip_space(ptr + 1);
+	if (*ptr == ']')
+		return ptr + 1;
+
+	while (*ptr == '"') {
+		end = ptr + 1 + strcspn(ptr + 1, "\"\\");
+		if (*end != '"')
+			return NULL;
+
+		if (params) {
+			addr = og_arena_alloc(params->arena, end - ptr);
+			if (!addr)
+				return NULL;
+
+			memcpy(addr, ptr + 1, end - ptr - 1);
+			addr[end - ptr - 1] = '\0';
+			params->ips_array[params->ips_array_len++] = addr;
+		}
+		(*len)++;
+
+		ptr = og_json_skip_space(end + 1);
+		if (*ptr == ']')
+			return ptr + 1;
+		if (*ptr != ',')
+			return NULL;
+		ptr = og_json_skip_space(ptr + 1);
+	}
+
+	return NULL;
+}
+
+/* Requests may target thousands of clients, decoding them into a JSON object
+ * only to copy them into ips_array again is a waste. Take the addresses from
+ * the top-level "clients" array of strings and cut the member out of the body,
+ * so the JSON parser only sees the remaining parameters. Bodies in any other
+ * shape are left untouched for the JSON parser to deal with.
+ */
+static int og_rest_parse_clients(char *body, struct og_msg_params *params)
+{
+	const char *ptr, *key, *key_end, *value, *end = NULL;
+	char *start = NULL, *prev = NULL;
+	unsigned int len;
+
+	ptr = og_json_skip_space(body);
+	if (*ptr != '{')
+		return 0;
+
+	ptr = og_json_skip_space(ptr + 1);
+	while (*ptr == '"') {
+		key = ptr;
+		key_end = og_json_skip_string(key);
+		if (!key_end)
+			return 0;
+
+		ptr = og_json_skip_space(key_end);
+		if (*ptr != ':')
+			return 0;
+
+		value = og_json_skip_space(ptr + 1);
+		if (key_end - key == strlen("\"clients\"") &&
+		    !strncmp(key, "\"clients\"", key_end - key)) {
+			if (*value == '[')
+				end = og_json_scan_clients(value, NULL, &len);
+			if (!end)
+				return 0;
+
+			start = (char *)key;
+			break;
+		}
+
+		ptr = og_json_skip_value(value);
+		if (!ptr || *ptr != ',')
+			return 0;
+
+		prev = (char *)ptr;
+		ptr = og_json_skip_space(ptr + 1);
+	}
+
+	if (!start)
+		return 0;
+
+	if (len) {
+		if (og_msg_params_grow(params, len) < 0 ||
+		    !og_json_scan_clients(value, params, &len))
+			return -1;
+
+		params->flags |= OG_REST_PARAM_ADDR;
+	}
+
+	/* Cut the member together with one of its separating commas. */
+	ptr = og_json_skip_space(end);
+	if (*ptr == ',')
+		end = ptr + 1;
+	else if (prev)
+		start = prev;
+
+	memmove(start, end, strlen(end) + 1);
+
+	params->payload = body;
+	params->payload_len = strlen(body);
+
+	return len;
+}
+
+static int og_json_parse_sync_params(json_t *element, void *base)
+{
+	struct og_msg_params *params = base;
+
+	if (og_json_parse_params(element, &og_rest_sync_params,
+				 &params->sync_setup, &params->flags,
+				 OG_REST_PARAM_SYNC_ALL) < 0)
+		return -1;
+
+	return 0;
+}
+
+static int og_json_parse_partition_setup(json_t *element, void *base)
+{
+	struct og_msg_params *params = base;
+	unsigned int i;
+	json_t *k;
+
+	if (json_typeof(element) != JSON_ARRAY)
+		return -1;
+
+	for (i = 0; i < json_array_size(element) && i < OG_PARTITION_MAX; ++i) {
+		k = json_array_get(element, i);
+
+		if (json_typeof(k) != JSON_OBJECT)
+			return -1;
+
+		if (og_json_parse_partition(k, &params->partition_setup[i],
+					    OG_PARAM_PART_NUMBER |
+					    OG_PARAM_PART_CODE |
+					    OG_PARAM_PART_FILESYSTEM |
+					    OG_PARAM_PART_SIZE |
+					    OG_PARAM_PART_FORMAT) < 0)
+			return -1;
+
+		params->flags |= (OG_REST_PARAM_PART_0 << i);
+	}
+	return 0;
+}
+
+static int og_json_parse_time_params(json_t *element, void *base)
+{
+	struct og_msg_params *params = base;
+
+	if (og_json_parse_params(element, &og_rest_time_params, &params->time,
+				 &params->flags, OG_REST_PARAM_TIME_ALL) < 0)
+		return -1;
+
+	return 0;
+}
+
+/* Target scope, a room, a center or a computer group. */
+struct og_scope_target {
+	const char	*type;
+	uint32_t	id;
+};
+
+#define OG_REST_SCOPE_PARAMS(X)								\
+	X("type",	STRING,	type,		OG_REST_PARAM_SCOPE_TYPE,		NULL)	\
+	X("id",		UINT,	id,		OG_REST_PARAM_SCOPE_ID,			NULL)
+
+#define OG_REST_PARAM_SCOPE_ALL	(0 OG_REST_SCOPE_PARAMS(OG_JSON_PARAM_FLAG))
+
+static const struct og_json_param og_rest_scope_param[] = {
+#define X(...)	OG_JSON_PARAM(struct og_scope_target, __VA_ARGS__)
+	OG_REST_SCOPE_PARAMS(X)
+#undef X
+};
+
+static struct og_json_params og_rest_scope_params =
+	OG_JSON_PARAMS_INIT(og_rest_scope_param);
+
+/* These walk the computers in a scope, they are only counted if ips_array is
+ * NULL.
+ */
+static unsigned int og_scope_room_targets(struct og_scope_room *room,
+					  const char **ips_array)
+{
+	struct og_scope_computer *computer;
+	unsigned int len = 0;
+
+	list_for_each_entry(computer, &room->computer_list, list) {
+		if (ips_array)
+			ips_array[len] = computer->ip;
+		len++;
+	}
+
+	return len;
+}
+
+static unsigned int og_scope_center_targets(struct og_scope_center *center,
+					    const char **ips_array)
+{
+	struct og_scope_room *room;
+	unsigned int len = 0;
+
+	list_for_each_entry(room, &center->room_list, list)
+		len += og_scope_room_targets(room,
+					     ips_array ? ips_array + len : NULL);
+
+	return len;
+}
+
+/* Subgroups are only walked a few levels deep, in case there is a loop. */
+#define OG_SCOPE_GROUP_DEPTH	16
+
+static unsigned int og_scope_group_targets(struct og_scope_group *group,
+					   const char **ips_array,
+					   unsigned int depth)
+{
+	struct og_scope_computer *computer;
+	struct og_scope_group *child;
+	unsigned int len = 0;
+
+	list_for_each_entry(computer, &group->computer_list, group_list) {
+		if (ips_array)
+			ips_array[len] = computer->ip;
+		len++;
+	}
+
+	if (depth == OG_SCOPE_GROUP_DEPTH)
+		return len;
+
+	list_for_each_entry(child, &og_scope_tree.group_list, list) {
+		if (child->parent_id != group->id)
+			continue;
+
+		len += og_scope_group_targets(child,
+					      ips_array ? ips_array + len : NULL,
+					      depth + 1);
+	}
+
+	return len;
+}
+
+/* Expand the scope from the cached scope tree. The addresses are not copied,
+ * the tree is not reloaded again while this request is processed.
+ */
+static int og_json_parse_scope(json_t *element, void *base)
+{
+	struct og_msg_params *params = base;
+	struct og_scope_center *center = NULL;
+	struct og_scope_group *group = NULL;
+	struct og_scope_room *room = NULL;
+	struct og_scope_target target = {};
+	const char **ips_array;
+	uint64_t flags = 0;
+	unsigned int len;
+
+	if (og_json_parse_params(element, &og_rest_scope_params, &target,
+				 &flags, OG_REST_PARAM_SCOPE_ALL) < 0 ||
+	    flags != OG_REST_PARAM_SCOPE_ALL)
+		return -1;
+
+	if (og_scope_refresh() < 0)
+		return -1;
+
+	if (!strcmp(target.type, "room")) {
+		room = og_scope_room_lookup(target.id);
+		if (!room)
+			return -1;
+		len = og_scope_room_targets(room, NULL);
+	} else if (!strcmp(target.type, "center")) {
+		center = og_scope_center_lookup(target.id);
+		if (!center)
+			return -1;
+		len = og_scope_center_targets(center, NULL);
+	} else if (!strcmp(target.type, "group")) {
+		group = og_scope_group_lookup(target.id);
+		if (!group)
+			return -1;
+		len = og_scope_group_targets(group, NULL, 0);
+	} else {
+		return -1;
+	}
+
+	if (og_msg_params_grow(params, len) < 0)
+		return -1;
+
+	ips_array = params->ips_array + params->ips_array_len;
+	if (room)
+		og_scope_room_targets(room, ips_array);
+	else if (center)
+		og_scope_center_targets(center, ips_array);
+	else
+		og_scope_group_targets(group, ips_array, 0);
+
+	params->ips_array_len += len;
+	params->flags |= OG_REST_PARAM_SCOPE;
+	if (len)
+		params->flags |= OG_REST_PARAM_ADDR;
+
+	return 0;
+}
+
+static int og_json_parse_run(json_t *element, void *base)
+{
+	struct og_msg_params *params = base;
+
+	if (json_typeof(element) != JSON_STRING)
+		return -1;
+
+	snprintf(params->run_cmd, sizeof(params->run_cmd), "%s",
+		 json_string_value(element));
+
+	params->flags |= OG_REST_PARAM_RUN_CMD;
+
+	return 0;
+}
+
+/*	key			type	field		flag				parser */
+#define OG_REST_PARAMS(X)									\
+	X("clients",		FUNC,	ips_array,	OG_REST_PARAM_ADDR,		og_json_parse_clients)	\
+	X("scope",		FUNC,	ips_array,	OG_REST_PARAM_ADDR,		og_json_parse_scope)	\
+	X("disk",		STRING,	disk,		OG_REST_PARAM_DISK,		NULL)	\
+	X("partition",		STRING,	partition,	OG_REST_PARAM_PARTITION,	NULL)	\
+	X("name",		STRING,	name,		OG_REST_PARAM_NAME,		NULL)	\
+	X("repository",		STRING,	repository,	OG_REST_PARAM_REPO,		NULL)	\
+	X("id",			STRING,	id,		OG_REST_PARAM_ID,		NULL)	\
+	X("code",		STRING,	code,		OG_REST_PARAM_CODE,		NULL)	\
+	X("type",		STRING,	type,		OG_REST_PARAM_TYPE,		NULL)	\
+	X("profile",		STRING,	profile,	OG_REST_PARAM_PROFILE,		NULL)	\
+	X("cache",		STRING,	cache,		OG_REST_PARAM_CACHE,		NULL)	\
+	X("cache_size",		STRING,	cache_size,	OG_REST_PARAM_CACHE_SIZE,	NULL)	\
+	X("task",		STRING,	task_id,	OG_REST_PARAM_TASK,		NULL)	\
+	X("echo",		BOOL,	echo,		OG_REST_PARAM_ECHO,		NULL)	\
+	X("run",		FUNC,	run_cmd,	OG_REST_PARAM_RUN_CMD,		og_json_parse_run)	\
+	X("partition_setup",	FUNC,	partition_setup, OG_REST_PARAM_PART_ALL,	og_json_parse_partition_setup) \
+	X("sync_params",	FUNC,	sync_setup,	OG_REST_PARAM_SYNC_ALL,		og_json_parse_sync_params) \
+	X("when",		FUNC,	time,		OG_REST_PARAM_TIME_ALL,		og_json_parse_time_params)
+
+static const struct og_json_param og_rest_param[] = {
+#define X(...)	OG_JSON_PARAM(struct og_msg_params, __VA_ARGS__)
+	OG_REST_PARAMS(X)
+#undef X
+};
+
+static struct og_json_params og_rest_params =
+	OG_JSON_PARAMS_INIT(og_rest_param);
+
+/* Decode the keys that are needed to validate the required flags, any other
+ * key in the request is ignored.
+ */
+static int og_msg_params_parse(json_t *element, struct og_msg_params *params,
+			       uint64_t required)
+{
+	if (og_json_parse_params(element, &og_rest_params, params,
+				 &params->flags, required) < 0)
+		return -1;
+
+	if (!og_msg_params_validate(params, required))
+		return -1;
+
+	return 0;
+}
+
+/* Value of @key in the query string of GET requests, values are taken as is,
+ * they are not percent-decoded.
+ */
+static const char *og_rest_query_get(const struct og_msg_params *params,
+				     const char *key, size_t *len)
+{
+	const char *ptr = params->query, *end, *next;
+	size_t key_len = strlen(key);
+
+	if (!ptr)
+		return NULL;
+
+	for (end = ptr + params->query_len; ptr < end; ptr = next + 1) {
+		next = memchr(ptr, '&', end - ptr);
+		if (!next)
+			next = end;
+
+		if ((size_t)(next - ptr) > key_len &&
+		    !strncmp(ptr, key, key_len) && ptr[key_len] == '=') {
+			*len = next - ptr - key_len - 1;
+			return ptr + key_len + 1;
+		}
+	}
+
+	return NULL;
+}
+
+/* Returns 1 if @key is set to a valid number, 0 if it is not in the query
+ * string and -1 otherwise.
+ */
+static int og_rest_query_uint(const struct og_msg_params *params,
+			      const char *key, uint32_t *value)
+{
+	const char *str;
+	char buf[16];
+	unsigned long val;
+	char *end;
+	size_t len;
+
+	str = og_rest_query_get(params, key, &len);
+	if (!str)
+		return 0;
+
+	if (!len || len >= sizeof(buf) || str[0] < '0' || str[0] > '9')
+		return -1;
+
+	memcpy(buf, str, len);
+	buf[len] = '\0';
+
+	errno = 0;
+	val = strtoul(buf, &end, 10);
+	if (*end || errno || val > UINT32_MAX)
+		return -1;
+
+	*value = val;
+
+	return 1;
+}
+
+static const char *og_cmd_to_uri[OG_CMD_MAX] = {
+	[OG_CMD_WOL]		= "wol",
+	[OG_CMD_PROBE]		= "probe",
+	[OG_CMD_SHELL_RUN]	= "shell/run",
+	[OG_CMD_SESSION]	= "session",
+	[OG_CMD_POWEROFF]	= "poweroff",
+	[OG_CMD_REFRESH]	= "refresh",
+	[OG_CMD_REBOOT]		= "reboot",
+	[OG_CMD_STOP]		= "stop",
+	[OG_CMD_HARDWARE]	= "hardware",
+	[OG_CMD_SOFTWARE]	= "software",
+	[OG_CMD_IMAGE_CREATE]	= "image/create",
+	[OG_CMD_IMAGE_RESTORE]	= "image/restore",
+	[OG_CMD_SETUP]		= "setup",
+	[OG_CMD_RUN_SCHEDULE]	= "run/schedule",
+};
+
+static bool og_client_is_busy(const struct og_client *cli,
+			      enum og_cmd_type type)
+{
+	switch (type) {
+	case OG_CMD_REBOOT:
+	case OG_CMD_POWEROFF:
+	case OG_CMD_STOP:
+		break;
+	default:
+		if (cli->last_cmd != OG_CMD_UNSPEC)
+			return true;
+		break;
+	}
+
+	return false;
+}
+
+static int og_request_format(char *buf, size_t size,
+			     enum og_rest_method method, enum og_cmd_type type,
+			     const char *content, unsigned int content_length)
+{
+	const char *content_type = "Content-Type: application/json";
+	const char *method_str;
+	int len;
+
+	if (method == OG_METHOD_GET)
+		method_str = "GET";
+	else if (method == OG_METHOD_POST)
+		method_str = "POST";
+	else
+		return -1;
+
+	len = snprintf(buf, size,
+		       "%s /%s HTTP/1.1\r\nContent-Length: %d\r\n%s\r\n\r\n%.*s",
+		       method_str, og_cmd_to_uri[type], content_length,
+		       content_type, content_length, content);
+	if (len >= (int)size)
+		return -1;
+
+	return len;
+}
+
+static int og_client_send(struct og_client *cli, enum og_cmd_type type,
+			  const char *buf, int len)
+{
+	if (og_client_is_busy(cli, type))
+		return -1;
+
+	if (cli->io.fd < 0) {
+		syslog(LOG_INFO, "Client %s not conected\n",
+		       inet_ntoa(cli->addr.sin_addr));
+		return -1;
+	}
+
+	if (send(cli->io.fd, buf, len, 0) < 0)
+		return -1;
+
+	cli->last_cmd = type;
+	og_client_changed(cli);
+
+	return 0;
+}
+
+static int og_send_request_content(enum og_rest_method method,
+				   enum og_cmd_type type,
+				   const struct og_msg_params *params,
+				   const char *content,
+				   unsigned int content_length)
+{
+	char buf[OG_MSG_REQUEST_MAXLEN];
+	struct og_client *cli;
+	unsigned int i;
+	int len;
+
+	len = og_request_format(buf, sizeof(buf), method, type, content,
+				content_length);
+	if (len < 0)
+		return -1;
+
+	for (i = 0; i < params->ips_array_len; i++) {
+		cli = og_client_find(params->ips_array[i]);
+		if (!cli)
+			continue;
+
+		og_client_send(cli, type, buf, len);
+	}
+
+	return 0;
+}
+
+int og_send_request(enum og_rest_method method, enum og_cmd_type type,
+		    const struct og_msg_params *params,
+		    const json_t *data)
+{
+	char content[OG_MSG_REQUEST_MAXLEN - 700];
+	size_t content_length = 0;
+
+	if (data) {
+		content_length = json_dumpb(data, content, sizeof(content),
+					    JSON_COMPACT);
+		if (content_length > sizeof(content))
+			return -1;
+	}
+
+	return og_send_request_content(method, type, params, content,
+				       content_length);
+}
+
+/* Forward the request to the agents without the "clients" member. The body is
+ * sent as is if og_rest_parse_clients() already cut that member out of it,
+ * anything else is serialized once again.
+ */
+static int og_send_request_payload(enum og_rest_method method,
+				   enum og_cmd_type type,
+				   const struct og_msg_params *params,
+				   json_t *element)
+{
+	json_t *data;
+	int err;
+
+	if (params->payload && !(params->flags & OG_REST_PARAM_SCOPE))
+		return og_send_request_content(method, type, params,
+					       params->payload,
+					       params->payload_len);
+
+	data = json_copy(element);
+	if (!data)
+		return -1;
+
+	json_object_del(data, "clients");
+	json_object_del(data, "scope");
+	err = og_send_request(method, type, params, data);
+	json_decref(data);
+
+	return err;
+}
+
+int og_cmd_send(struct og_client *cli, const struct og_cmd *cmd)
+{
+	char buf[OG_MSG_REQUEST_MAXLEN];
+	int len;
+
+	len = og_request_format(buf, sizeof(buf), cmd->method, cmd->type,
+				cmd->payload ? cmd->payload->data : "",
+				cmd->payload ? cmd->payload->len : 0);
+	if (len < 0)
+		return -1;
+
+	return og_client_send(cli, cmd->type, buf, len);
+}
+
+static int og_cmd_post_clients(json_t *element, struct og_msg_params *params)
+{
+	if (og_msg_params_parse(element, params, OG_REST_PARAM_ADDR) < 0)
+		return -1;
+
+	return og_send_request(OG_METHOD_POST, OG_CMD_PROBE, params, NULL);
+}
+
+/* Response body, grows as the handler dumps its reply into it. */
+struct og_buffer {
+	char	*data;
+	size_t	len;
+	size_t	size;
+};
+
+#define OG_BUFFER_MINLEN	4096
+
+static int og_buffer_reserve(struct og_buffer *og_buffer, size_t size)
+{
+	size_t new_size;
+	char *new_data;
+
+	if (og_buffer->len + size <= og_buffer->size)
+		return 0;
+
+	new_size = og_buffer->size ? og_buffer->size : OG_BUFFER_MINLEN;
+	while (new_size < og_buffer->len + size)
+		new_size *= 2;
+
+	new_data = realloc(og_buffer->data, new_size);
+	if (!new_data)
+		return -1;
+
+	og_buffer->data = new_data;
+	og_buffer->size = new_size;
+
+	return 0;
+}
+
+static int og_json_dump_clients(const char *buffer, size_t size, void *data)
+{
+	struct og_buffer *og_buffer = (struct og_buffer *)data;
+
+	if (og_buffer_reserve(og_buffer, size) < 0)
+		return -1;
+
+	memcpy(og_buffer->data + og_buffer->len, buffer, size);
+	og_buffer->len += size;
+
+	return 0;
+}
+
+static int og_buffer_printf(struct og_buffer *og_buffer, const char *fmt, ...)
+{
+	char buf[256];
+	va_list args;
+	int len;
+
+	va_start(args, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+
+	if (len < 0 || len >= (int)sizeof(buf))
+		return -1;
+
+	return og_json_dump_clients(buf, len, og_buffer);
+}
+
+/* Replies are compressed if the client accepts it and they are larger than
+ * this, smaller ones are not worth the cost.
+ */
+#define OG_DEFLATE_MINLEN	1024
+
+static const char *og_encoding_str[] = {
+	[OG_ENCODING_GZIP]	= "gzip",
+	[OG_ENCODING_DEFLATE]	= "deflate",
+};
+
+static int og_deflate_init(z_stream *zs, enum og_encoding encoding)
+{
+	int window_bits = MAX_WBITS;
+
+	/* zlib adds the gzip header and trailer with this offset. */
+	if (encoding == OG_ENCODING_GZIP)
+		window_bits += 16;
+
+	memset(zs, 0, sizeof(*zs));
+	if (deflateInit2(zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, window_bits, 8,
+			 Z_DEFAULT_STRATEGY) != Z_OK)
+		return -1;
+
+	return 0;
+}
+
+/* Compress len bytes and append the output to og_buffer, set finish to flush
+ * what is still pending in the compressor.
+ */
+static int og_deflate(z_stream *zs, const char *data, size_t len,
+		      struct og_buffer *og_buffer, bool finish)
+{
+	int ret;
+
+	zs->next_in = (Bytef *)data;
+	zs->avail_in = len;
+
+	do {
+		if (og_buffer_reserve(og_buffer, OG_BUFFER_MINLEN) < 0)
+			return -1;
+
+		zs->next_out = (Bytef *)og_buffer->data + og_buffer->len;
+		zs->avail_out = og_buffer->size - og_buffer->len;
+
+		ret = deflate(zs, finish ? Z_FINISH : Z_NO_FLUSH);
+		if (ret == Z_STREAM_ERROR)
+			return -1;
+
+		og_buffer->len = og_buffer->size - zs->avail_out;
+	} while (zs->avail_out == 0 || (finish && ret != Z_STREAM_END));
+
+	return 0;
+}
+
+/* Compressed copies of the latest replies that carry an entity tag, so the
+ * web console polling /clients or /scopes does not pay for compression over
+ * and over again while nothing has changed.
+ */
+#define OG_DEFLATE_CACHE_MAX	4
+#define OG_DEFLATE_CACHE_MAXLEN	(4 * 1024 * 1024)
+
+struct og_deflate_cache {
+	char			etag[OG_ETAG_MAXLEN];
+	struct og_buffer	data;
+};
+
+static struct og_deflate_cache deflate_cache[OG_DEFLATE_CACHE_MAX];
+static unsigned int deflate_cache_next;
+
+static const struct og_buffer *og_deflate_cache_find(const char *etag)
+{
+	int i;
+
+	for (i = 0; i < OG_DEFLATE_CACHE_MAX; i++) {
+		if (deflate_cache[i].etag[0] &&
+		    !strcmp(deflate_cache[i].etag, etag))
+			return &deflate_cache[i].data;
+	}
+
+	return NULL;
+}
+
+/* Takes ownership of the buffer. */
+static void og_deflate_cache_add(const char *etag, struct og_buffer *og_buffer)
+{
+	struct og_deflate_cache *entry;
+
+	entry = &deflate_cache[deflate_cache_next++ % OG_DEFLATE_CACHE_MAX];
+	free(entry->data.data);
+
+	snprintf(entry->etag, sizeof(entry->etag), "%s", etag);
+	entry->data = *og_buffer;
+	memset(og_buffer, 0, sizeof(*og_buffer));
+}
+
+/* Replies that grow with the number of clients, rooms or schedules are sent
+ * with chunked transfer encoding. The next() callback serializes one row at a
+ * time as the socket becomes writable, so only one chunk is held in memory
+ * regardless of the size of the reply.
+ */
+#define OG_STREAM_CHUNK_LEN	16384
+
+enum og_stream_type {
+	OG_STREAM_CLIENTS,
+	OG_STREAM_SCOPE,
+	OG_STREAM_SCHEDULE,
+	OG_STREAM_EVENTS,
+};
+
+struct og_stream {
+	struct list_head	list;
+	enum og_stream_type	type;
+	int			(*next)(struct og_stream *stream);
+	struct og_buffer	chunk;
+	struct og_buffer	out;
+	size_t			out_off;
+	bool			first;
+	bool			done;
+	bool			deflate;
+	z_stream		zs;
+	struct og_buffer	zbuf;
+	struct og_buffer	cache;
+	char			etag[OG_ETAG_MAXLEN];
+	union {
+		struct {
+			struct list_head	*pos;
+		} clients;
+		struct {
+			struct list_head	*center;
+			struct list_head	*room;
+			struct list_head	*computer;
+			int			level;
+		} scope;
+		struct {
+			struct og_dbi		*dbi;
+			dbi_result		result;
+		} schedule;
+		struct {
+			struct og_client	*cli;
+		} events;
+	};
+};
+
+static LIST_HEAD(stream_list);
+
+static unsigned int og_events_users;
+static struct ev_timer og_events_timer;
+
+static struct og_stream *og_stream_new(struct og_client *cli,
+				       enum og_stream_type type,
+				       int (*next)(struct og_stream *stream))
+{
+	struct og_stream *stream;
+
+	stream = calloc(1, sizeof(struct og_stream));
+	if (!stream)
+		return NULL;
+
+	stream->type = type;
+	stream->next = next;
+	stream->first = true;
+	list_add(&stream->list, &stream_list);
+	cli->stream = stream;
+
+	return stream;
+}
+
+void og_client_stream_free(struct og_client *cli)
+{
+	struct og_stream *stream = cli->stream;
+
+	if (!stream)
+		return;
+
+	switch (stream->type) {
+	case OG_STREAM_SCOPE:
+		og_scope_tree.users--;
+		break;
+	case OG_STREAM_SCHEDULE:
+		if (stream->schedule.result)
+			dbi_result_free(stream->schedule.result);
+		og_dbi_close(stream->schedule.dbi);
+		break;
+	case OG_STREAM_EVENTS:
+		if (!--og_events_users)
+			ev_timer_stop(og_loop, &og_events_timer);
+		break;
+	default:
+		break;
+	}
+
+	if (stream->deflate)
+		deflateEnd(&stream->zs);
+
+	list_del(&stream->list);
+	free(stream->chunk.data);
+	free(stream->out.data);
+	free(stream->zbuf.data);
+	free(stream->cache.data);
+	free(stream);
+	cli->stream = NULL;
+}
+
+/* Clients that go away while a client list is being streamed must not be
+ * left behind as the cursor.
+ */
+static void og_stream_client_del(struct og_client *cli)
+{
+	struct og_stream *stream;
+
+	list_for_each_entry(stream, &stream_list, list) {
+		if (stream->type == OG_STREAM_CLIENTS &&
+		    stream->clients.pos == &cli->list)
+			stream->clients.pos = cli->list.prev;
+	}
+}
+
+static int og_stream_produce(struct og_stream *stream)
+{
+	int ret;
+
+	while (!stream->done && stream->chunk.len < OG_STREAM_CHUNK_LEN) {
+		ret = stream->next(stream);
+		if (ret < 0)
+			return -1;
+		if (ret > 0)
+			stream->done = true;
+	}
+
+	return 0;
+}
+
+/* Compressed output is kept aside too until the reply is complete, then it
+ * goes to the cache, unless it turns out to be too large to be cached.
+ */
+static int og_stream_deflate(struct og_stream *stream)
+{
+	do {
+		if (og_stream_produce(stream) < 0 ||
+		    og_deflate(&stream->zs, stream->chunk.data,
+			       stream->chunk.len, &stream->zbuf,
+			       stream->done) < 0)
+			return -1;
+
+		stream->chunk.len = 0;
+	} while (!stream->done && !stream->zbuf.len);
+
+	if (!stream->etag[0])
+		return 0;
+
+	if (stream->cache.len + stream->zbuf.len > OG_DEFLATE_CACHE_MAXLEN) {
+		stream->etag[0] = '\0';
+		return 0;
+	}
+
+	if (og_json_dump_clients(stream->zbuf.data, stream->zbuf.len,
+				 &stream->cache) < 0)
+		return -1;
+
+	if (stream->done)
+		og_deflate_cache_add(stream->etag, &stream->cache);
+
+	return 0;
+}
+
+static int og_stream_fill(struct og_stream *stream)
+{
+	struct og_buffer *payload = &stream->chunk;
+
+	if (stream->deflate) {
+		if (og_stream_deflate(stream) < 0)
+			return -1;
+
+		payload = &stream->zbuf;
+	} else if (og_stream_produce(stream) < 0) {
+		return -1;
+	}
+
+	stream->out.len = 0;
+	stream->out_off = 0;
+
+	if (payload->len &&
+	    (og_buffer_printf(&stream->out, "%zx\r\n", payload->len) < 0 ||
+	     og_json_dump_clients(payload->data, payload->len,
+				  &stream->out) < 0 ||
+	     og_buffer_printf(&stream->out, "\r\n") < 0))
+		return -1;
+
+	payload->len = 0;
+
+	if (stream->done &&
+	    og_buffer_printf(&stream->out, "0\r\n\r\n") < 0)
+		return -1;
+
+	return 0;
+}
+
+/* Returns 1 if there is more to send, 2 if the stream waits for events to be
+ * queued and 0 once the reply is complete.
+ */
+int og_client_stream_send(struct og_client *cli)
+{
+	struct og_stream *stream = cli->stream;
+	ssize_t ret;
+
+	if (stream->out_off == stream->out.len) {
+		if (stream->done)
+			return 0;
+		if (stream->type == OG_STREAM_EVENTS) {
+			stream->out.len = 0;
+			stream->out_off = 0;
+			return 2;
+		}
+		if (og_stream_fill(stream) < 0)
+			return -1;
+	}
 
-static LIST_HEAD(client_list);
+	ret = send(og_client_socket(cli), stream->out.data + stream->out_off,
+		   stream->out.len - stream->out_off, MSG_NOSIGNAL);
+	if (ret < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return 1;
+		return -1;
+	}
+	stream->out_off += ret;
 
-void og_client_add(struct og_client *cli)
-{
-	list_add(&cli->list, &client_list);
+	return !stream->done || stream->out_off < stream->out.len;
 }
 
-static struct og_client *og_client_find(const char *ip)
+static int og_stream_clients_next(struct og_stream *stream)
 {
 	struct og_client *client;
-	struct in_addr addr;
-	int res;
+	struct list_head *pos;
 
-	res = inet_aton(ip, &addr);
-	if (!res) {
-		syslog(LOG_ERR, "Invalid IP string: %s\n", ip);
-		return NULL;
-	}
+	pos = stream->clients.pos->next;
+	if (pos == &client_list)
+		return og_buffer_printf(&stream->chunk, "]}") < 0 ? -1 : 1;
 
-	list_for_each_entry(client, &client_list, list) {
-		if (client->addr.sin_addr.s_addr == addr.s_addr && client->agent) {
-			return client;
-		}
-	}
+	stream->clients.pos = pos;
+	client = list_entry(pos, struct og_client, list);
+	if (!client->agent)
+		return 0;
 
-	return NULL;
-}
+	if (og_buffer_printf(&stream->chunk,
+			     "%s{\"addr\": \"%s\", \"state\": \"%s\"}",
+			     stream->first ? "" : ", ",
+			     inet_ntoa(client->addr.sin_addr),
+			     og_client_status(client)) < 0)
+		return -1;
 
-static const char *og_client_status(const struct og_client *cli)
-{
-	if (cli->last_cmd != OG_CMD_UNSPEC)
-		return "BSY";
+	stream->first = false;
 
-	switch (cli->status) {
-	case OG_CLIENT_STATUS_BUSY:
-		return "BSY";
-	case OG_CLIENT_STATUS_OGLIVE:
-		return "OPG";
-	case OG_CLIENT_STATUS_VIRTUAL:
-		return "VRT";
-	default:
-		return "OFF";
-	}
+	return 0;
 }
 
-static bool og_msg_params_validate(const struct og_msg_params *params,
-				   const uint64_t flags)
+static int og_stream_clients_end(struct og_stream *stream)
 {
-	return (params->flags & flags) == flags;
+	return og_buffer_printf(&stream->chunk, "]}") < 0 ? -1 : 1;
 }
 
-static int og_json_parse_clients(json_t *element, struct og_msg_params *params)
+/* Agents changed after @since, oldest first, those that are gone are reported
+ * as OFF. The reply is built at once since agents move in the change list.
+ * Pollers that are too far behind, or ahead after a restart, get every agent
+ * that is tracked and must replace their copy.
+ */
+static int og_stream_clients_since(struct og_stream *stream, uint32_t since)
 {
-	unsigned int i;
-	json_t *k;
+	struct og_agent *agent;
+	bool full;
 
-	if (json_typeof(element) != JSON_ARRAY)
+	if (since < og_agent_seq_floor || since > og_client_version)
+		since = 0;
+	full = !since;
+
+	if (og_buffer_printf(&stream->chunk,
+			     "{\"seq\": %u, \"full\": %s, \"clients\": [",
+			     og_client_version, full ? "true" : "false") < 0)
 		return -1;
 
-	for (i = 0; i < json_array_size(element); i++) {
-		k = json_array_get(element, i);
-		if (json_typeof(k) != JSON_STRING)
-			return -1;
+	list_for_each_entry_reverse(agent, &agent_seq_list, seq_list) {
+		if (agent->seq <= since)
+			break;
+	}
 
-		params->ips_array[params->ips_array_len++] =
-			json_string_value(k);
+	list_for_each_entry_continue(agent, &agent_seq_list, seq_list) {
+		if (og_buffer_printf(&stream->chunk,
+				     "%s{\"addr\": \"%s\", \"state\": \"%s\"}",
+				     stream->first ? "" : ", ",
+				     inet_ntoa(agent->addr),
+				     agent->cli ? og_client_status(agent->cli) : "OFF") < 0)
+			return -1;
 
-		params->flags |= OG_REST_PARAM_ADDR;
+		stream->first = false;
 	}
 
 	return 0;
 }
 
-static int og_json_parse_sync_params(json_t *element,
-				     struct og_msg_params *params)
+/* Filters on GET /clients, addresses are in host byte order. Pages are sorted
+ * by address, the cursor is the last address of the previous page.
+ */
+struct og_clients_filter {
+	const char	*state;
+	size_t		state_len;
+	uint32_t	room;
+	uint32_t	center;
+	uint32_t	addr_min;
+	uint32_t	addr_max;
+	uint32_t	limit;
+};
+
+/* Returns 1 if @key is set to a valid address, 0 if it is not in the query
+ * string and -1 otherwise.
+ */
+static int og_rest_query_addr(const struct og_msg_params *params,
+			      const char *key, uint32_t *addr)
 {
-	const char *key;
-	json_t *value;
-	int err = 0;
+	char buf[INET_ADDRSTRLEN];
+	struct in_addr in;
+	const char *str;
+	size_t len;
 
-	json_object_foreach(element, key, value) {
-		if (!strcmp(key, "sync")) {
-			err = og_json_parse_string(value, &params->sync_setup.sync);
-			params->flags |= OG_REST_PARAM_SYNC_SYNC;
-		} else if (!strcmp(key, "diff")) {
-			err = og_json_parse_string(value, &params->sync_setup.diff);
-			params->flags |= OG_REST_PARAM_SYNC_DIFF;
-		} else if (!strcmp(key, "remove")) {
-			err = og_json_parse_string(value, &params->sync_setup.remove);
-			params->flags |= OG_REST_PARAM_SYNC_REMOVE;
-		} else if (!strcmp(key, "compress")) {
-			err = og_json_parse_string(value, &params->sync_setup.compress);
-			params->flags |= OG_REST_PARAM_SYNC_COMPRESS;
-		} else if (!strcmp(key, "cleanup")) {
-			err = og_json_parse_string(value, &params->sync_setup.cleanup);
-			params->flags |= OG_REST_PARAM_SYNC_CLEANUP;
-		} else if (!strcmp(key, "cache")) {
-			err = og_json_parse_string(value, &params->sync_setup.cache);
-			params->flags |= OG_REST_PARAM_SYNC_CACHE;
-		} else if (!strcmp(key, "cleanup_cache")) {
-			err = og_json_parse_string(value, &params->sync_setup.cleanup_cache);
-			params->flags |= OG_REST_PARAM_SYNC_CLEANUP_CACHE;
-		} else if (!strcmp(key, "remove_dst")) {
-			err = og_json_parse_string(value, &params->sync_setup.remove_dst);
-			params->flags |= OG_REST_PARAM_SYNC_REMOVE_DST;
-		} else if (!strcmp(key, "diff_id")) {
-			err = og_json_parse_string(value, &params->sync_setup.diff_id);
-			params->flags |= OG_REST_PARAM_SYNC_DIFF_ID;
-		} else if (!strcmp(key, "diff_name")) {
-			err = og_json_parse_string(value, &params->sync_setup.diff_name);
-			params->flags |= OG_REST_PARAM_SYNC_DIFF_NAME;
-		} else if (!strcmp(key, "path")) {
-			err = og_json_parse_string(value, &params->sync_setup.path);
-			params->flags |= OG_REST_PARAM_SYNC_PATH;
-		} else if (!strcmp(key, "method")) {
-			err = og_json_parse_string(value, &params->sync_setup.method);
-			params->flags |= OG_REST_PARAM_SYNC_METHOD;
-		}
+	str = og_rest_query_get(params, key, &len);
+	if (!str)
+		return 0;
 
-		if (err != 0)
-			return err;
-	}
-	return err;
+	if (len >= sizeof(buf))
+		return -1;
+
+	memcpy(buf, str, len);
+	buf[len] = '\0';
+
+	/* Only dotted-quad addresses, inet_aton() also takes short forms. */
+	if (inet_pton(AF_INET, buf, &in) != 1)
+		return -1;
+
+	*addr = ntohl(in.s_addr);
+
+	return 1;
 }
 
-static int og_json_parse_partition_setup(json_t *element,
-					 struct og_msg_params *params)
+/* Returns 1 if the query string has any filter, 0 if it has none and -1 if a
+ * filter is malformed.
+ */
+static int og_clients_filter_parse(const struct og_msg_params *params,
+				   struct og_clients_filter *filter)
 {
-	unsigned int i;
-	json_t *k;
+	uint32_t cursor;
+	int ret, found;
 
-	if (json_typeof(element) != JSON_ARRAY)
+	memset(filter, 0, sizeof(*filter));
+	filter->addr_max = UINT32_MAX;
+
+	filter->state = og_rest_query_get(params, "state", &filter->state_len);
+	found = !!filter->state;
+
+	ret = og_rest_query_uint(params, "room", &filter->room);
+	if (ret < 0)
 		return -1;
+	found |= ret;
 
-	for (i = 0; i < json_array_size(element) && i < OG_PARTITION_MAX; ++i) {
-		k = json_array_get(element, i);
+	ret = og_rest_query_uint(params, "center", &filter->center);
+	if (ret < 0)
+		return -1;
+	found |= ret;
 
-		if (json_typeof(k) != JSON_OBJECT)
-			return -1;
+	ret = og_rest_query_addr(params, "from", &filter->addr_min);
+	if (ret < 0)
+		return -1;
+	found |= ret;
 
-		if (og_json_parse_partition(k, &params->partition_setup[i],
-					    OG_PARAM_PART_NUMBER |
-					    OG_PARAM_PART_CODE |
-					    OG_PARAM_PART_FILESYSTEM |
-					    OG_PARAM_PART_SIZE |
-					    OG_PARAM_PART_FORMAT) < 0)
-			return -1;
+	ret = og_rest_query_addr(params, "to", &filter->addr_max);
+	if (ret < 0)
+		return -1;
+	found |= ret;
 
-		params->flags |= (OG_REST_PARAM_PART_0 << i);
+	ret = og_rest_query_uint(params, "limit", &filter->limit);
+	if (ret < 0)
+		return -1;
+	found |= ret;
+
+	ret = og_rest_query_addr(params, "cursor", &cursor);
+	if (ret < 0)
+		return -1;
+	if (ret > 0) {
+		/* Nothing comes after the last address, the range is empty. */
+		if (cursor == UINT32_MAX) {
+			filter->addr_min = 1;
+			filter->addr_max = 0;
+		} else if (cursor >= filter->addr_min) {
+			filter->addr_min = cursor + 1;
+		}
 	}
-	return 0;
+	found |= ret;
+
+	return found;
 }
 
-static int og_json_parse_time_params(json_t *element,
-				     struct og_msg_params *params)
+static bool og_clients_filter_match(const struct og_clients_filter *filter,
+				    const struct og_agent *agent)
 {
-	const char *key;
-	json_t *value;
-	int err = 0;
+	uint32_t addr = ntohl(agent->addr.s_addr);
+	const char *state;
 
-	json_object_foreach(element, key, value) {
-		if (!strcmp(key, "years")) {
-			err = og_json_parse_uint(value, &params->time.years);
-			params->flags |= OG_REST_PARAM_TIME_YEARS;
-		} else if (!strcmp(key, "months")) {
-			err = og_json_parse_uint(value, &params->time.months);
-			params->flags |= OG_REST_PARAM_TIME_MONTHS;
-		} else if (!strcmp(key, "weeks")) {
-			err = og_json_parse_uint(value, &params->time.weeks);
-			params->flags |= OG_REST_PARAM_TIME_WEEKS;
-		} else if (!strcmp(key, "week_days")) {
-			err = og_json_parse_uint(value, &params->time.week_days);
-			params->flags |= OG_REST_PARAM_TIME_WEEK_DAYS;
-		} else if (!strcmp(key, "days")) {
-			err = og_json_parse_uint(value, &params->time.days);
-			params->flags |= OG_REST_PARAM_TIME_DAYS;
-		} else if (!strcmp(key, "hours")) {
-			err = og_json_parse_uint(value, &params->time.hours);
-			params->flags |= OG_REST_PARAM_TIME_HOURS;
-		} else if (!strcmp(key, "am_pm")) {
-			err = og_json_parse_uint(value, &params->time.am_pm);
-			params->flags |= OG_REST_PARAM_TIME_AM_PM;
-		} else if (!strcmp(key, "minutes")) {
-			err = og_json_parse_uint(value, &params->time.minutes);
-			params->flags |= OG_REST_PARAM_TIME_MINUTES;
-		}
-		if (err != 0)
-			return err;
-	}
+	if (!agent->cli || addr < filter->addr_min || addr > filter->addr_max)
+		return false;
 
-	return err;
-}
+	if (!filter->state)
+		return true;
 
-static const char *og_cmd_to_uri[OG_CMD_MAX] = {
-	[OG_CMD_WOL]		= "wol",
-	[OG_CMD_PROBE]		= "probe",
-	[OG_CMD_SHELL_RUN]	= "shell/run",
-	[OG_CMD_SESSION]	= "session",
-	[OG_CMD_POWEROFF]	= "poweroff",
-	[OG_CMD_REFRESH]	= "refresh",
-	[OG_CMD_REBOOT]		= "reboot",
-	[OG_CMD_STOP]		= "stop",
-	[OG_CMD_HARDWARE]	= "hardware",
-	[OG_CMD_SOFTWARE]	= "software",
-	[OG_CMD_IMAGE_CREATE]	= "image/create",
-	[OG_CMD_IMAGE_RESTORE]	= "image/restore",
-	[OG_CMD_SETUP]		= "setup",
-	[OG_CMD_RUN_SCHEDULE]	= "run/schedule",
-};
+	state = og_client_status(agent->cli);
 
-static bool og_client_is_busy(const struct og_client *cli,
-			      enum og_cmd_type type)
+	return strlen(state) == filter->state_len &&
+	       !strncmp(state, filter->state, filter->state_len);
+}
+
+static unsigned int og_clients_filter_room(const struct og_clients_filter *filter,
+					   const struct og_scope_room *room,
+					   struct og_agent **match,
+					   unsigned int max)
 {
-	switch (type) {
-	case OG_CMD_REBOOT:
-	case OG_CMD_POWEROFF:
-	case OG_CMD_STOP:
-		break;
-	default:
-		if (cli->last_cmd != OG_CMD_UNSPEC)
-			return true;
-		break;
+	struct og_scope_computer *computer;
+	struct og_agent *agent;
+	unsigned int len = 0;
+
+	list_for_each_entry(computer, &room->computer_list, list) {
+		if (len == max)
+			break;
+
+		agent = og_agent_lookup(computer->addr, false);
+		if (agent && og_clients_filter_match(filter, agent))
+			match[len++] = agent;
 	}
 
-	return false;
+	return len;
 }
 
-int og_send_request(enum og_rest_method method, enum og_cmd_type type,
-		    const struct og_msg_params *params,
-		    const json_t *data)
+static int og_agent_addr_cmp(const void *a, const void *b)
 {
-	const char *content_type = "Content-Type: application/json";
-	char content [OG_MSG_REQUEST_MAXLEN - 700] = {};
-	char buf[OG_MSG_REQUEST_MAXLEN] = {};
-	unsigned int content_length;
-	char method_str[5] = {};
-	struct og_client *cli;
-	const char *uri;
-	unsigned int i;
-	int client_sd;
+	uint32_t x = ntohl((*(struct og_agent * const *)a)->addr.s_addr);
+	uint32_t y = ntohl((*(struct og_agent * const *)b)->addr.s_addr);
 
-	if (method == OG_METHOD_GET)
-		snprintf(method_str, 5, "GET");
-	else if (method == OG_METHOD_POST)
-		snprintf(method_str, 5, "POST");
-	else
-		return -1;
+	return x < y ? -1 : x > y;
+}
 
-	if (!data)
-		content_length = 0;
-	else
-		content_length = json_dumpb(data, content,
-					    OG_MSG_REQUEST_MAXLEN - 700,
-					    JSON_COMPACT);
+/* Rooms and centers are looked up in the scope tree, so only the computers in
+ * them are visited, otherwise every connected agent is. Only the matching
+ * agents are sorted and serialized.
+ */
+static int og_stream_clients_filter(struct og_stream *stream,
+				    struct og_msg_params *params,
+				    const struct og_clients_filter *filter)
+{
+	unsigned int i, len = 0, max = og_agent_seq_len, end;
+	struct og_scope_center *center;
+	struct og_scope_room *room;
+	struct og_agent **match;
+	struct og_agent *agent;
+
+	match = og_arena_alloc(params->arena, (max + 1) * sizeof(*match));
+	if (!match)
+		return -1;
 
-	uri = og_cmd_to_uri[type];
-	snprintf(buf, OG_MSG_REQUEST_MAXLEN,
-		 "%s /%s HTTP/1.1\r\nContent-Length: %d\r\n%s\r\n\r\n%s",
-		 method_str, uri, content_length, content_type, content);
+	if ((filter->room || filter->center) && og_scope_refresh() < 0)
+		return -1;
 
-	for (i = 0; i < params->ips_array_len; i++) {
-		cli = og_client_find(params->ips_array[i]);
-		if (!cli)
-			continue;
+	if (filter->room) {
+		room = og_scope_room_lookup(filter->room);
+		if (room && (!filter->center || room->center_id == filter->center))
+			len = og_clients_filter_room(filter, room, match, max);
+	} else if (filter->center) {
+		center = og_scope_center_lookup(filter->center);
+		if (center) {
+			list_for_each_entry(room, &center->room_list, list)
+				len += og_clients_filter_room(filter, room,
+							      match + len,
+							      max - len);
+		}
+	} else {
+		list_for_each_entry(agent, &agent_seq_list, seq_list) {
+			if (len < max && og_clients_filter_match(filter, agent))
+				match[len++] = agent;
+		}
+	}
 
-		if (og_client_is_busy(cli, type))
-			continue;
+	qsort(match, len, sizeof(*match), og_agent_addr_cmp);
 
-		client_sd = cli->io.fd;
-		if (client_sd < 0) {
-			syslog(LOG_INFO, "Client %s not conected\n",
-			       params->ips_array[i]);
-			continue;
-		}
+	end = len;
+	if (filter->limit && filter->limit < len)
+		end = filter->limit;
 
-		if (send(client_sd, buf, strlen(buf), 0) < 0)
-			continue;
+	if (og_buffer_printf(&stream->chunk, "{") < 0 ||
+	    (end < len &&
+	     og_buffer_printf(&stream->chunk, "\"next\": \"%s\", ",
+			      inet_ntoa(match[end - 1]->addr)) < 0) ||
+	    og_buffer_printf(&stream->chunk, "\"clients\": [") < 0)
+		return -1;
 
-		cli->last_cmd = type;
+	for (i = 0; i < end; i++) {
+		if (og_buffer_printf(&stream->chunk,
+				     "%s{\"addr\": \"%s\", \"state\": \"%s\"}",
+				     i ? ", " : "",
+				     inet_ntoa(match[i]->addr),
+				     og_client_status(match[i]->cli)) < 0)
+			return -1;
 	}
 
 	return 0;
 }
 
-static int og_cmd_post_clients(json_t *element, struct og_msg_params *params)
+static int og_cmd_get_clients(json_t *element, struct og_msg_params *params,
+			      struct og_client *cli)
 {
-	const char *key;
-	json_t *value;
-	int err = 0;
-
-	if (json_typeof(element) != JSON_OBJECT)
+	struct og_clients_filter filter;
+	struct og_stream *stream;
+	uint32_t since;
+	int ret, found;
+
+	ret = og_rest_query_uint(params, "since", &since);
+	found = og_clients_filter_parse(params, &filter);
+	if (ret < 0 || found < 0 || (ret > 0 && found > 0))
 		return -1;
 
-	json_object_foreach(element, key, value) {
-		if (!strcmp(key, "clients"))
-			err = og_json_parse_clients(value, params);
+	if (found > 0) {
+		stream = og_stream_new(cli, OG_STREAM_CLIENTS,
+				       og_stream_clients_end);
+		if (!stream)
+			return -1;
 
-		if (err < 0)
-			break;
+		return og_stream_clients_filter(stream, params, &filter);
 	}
 
-	if (!og_msg_params_validate(params, OG_REST_PARAM_ADDR))
+	if (ret > 0) {
+		stream = og_stream_new(cli, OG_STREAM_CLIENTS,
+				       og_stream_clients_end);
+		if (!stream)
+			return -1;
+
+		return og_stream_clients_since(stream, since);
+	}
+
+	stream = og_stream_new(cli, OG_STREAM_CLIENTS, og_stream_clients_next);
+	if (!stream)
 		return -1;
 
-	return og_send_request(OG_METHOD_POST, OG_CMD_PROBE, params, NULL);
+	stream->clients.pos = &client_list;
+
+	return og_buffer_printf(&stream->chunk, "{\"clients\": [");
 }
 
-struct og_buffer {
-	char	*data;
-	int	len;
-};
+/* Server-Sent Events feed of client state changes. Subscribers stay idle
+ * until something changes, then the event is formatted once and queued to all
+ * of them. One timer sends the heartbeats for every subscriber.
+ */
+#define OG_EVENTS_HEARTBEAT	15.
+#define OG_EVENTS_BACKLOG_MAX	(256 * 1024)
 
-static int og_json_dump_clients(const char *buffer, size_t size, void *data)
+static void og_events_queue(struct og_stream *stream, const char *data,
+			    size_t len)
 {
-	struct og_buffer *og_buffer = (struct og_buffer *)data;
+	if (stream->done)
+		return;
 
-	memcpy(og_buffer->data + og_buffer->len, buffer, size);
-	og_buffer->len += size;
+	/* Drop what has been sent already, so the buffer is bounded by the
+	 * backlog of this subscriber.
+	 */
+	if (stream->out_off) {
+		memmove(stream->out.data, stream->out.data + stream->out_off,
+			stream->out.len - stream->out_off);
+		stream->out.len -= stream->out_off;
+		stream->out_off = 0;
+	}
 
-	return 0;
+	/* Subscribers that do not keep up are told to reconnect. */
+	if (stream->out.len - stream->out_off > OG_EVENTS_BACKLOG_MAX ||
+	    og_buffer_printf(&stream->out, "%zx\r\n", len) < 0 ||
+	    og_json_dump_clients(data, len, &stream->out) < 0 ||
+	    og_buffer_printf(&stream->out, "\r\n") < 0) {
+		og_buffer_printf(&stream->out, "0\r\n\r\n");
+		stream->done = true;
+	}
+
+	og_client_stream_wake(stream->events.cli);
 }
 
-static int og_cmd_get_clients(json_t *element, struct og_msg_params *params,
-			      char *buffer_reply)
+static void og_events_broadcast(const char *data, size_t len)
 {
-	json_t *root, *array, *addr, *state, *object;
-	struct og_client *client;
-	struct og_buffer og_buffer = {
-		.data	= buffer_reply,
-	};
+	struct og_stream *stream;
 
-	array = json_array();
-	if (!array)
-		return -1;
+	list_for_each_entry(stream, &stream_list, list) {
+		if (stream->type == OG_STREAM_EVENTS)
+			og_events_queue(stream, data, len);
+	}
+}
 
-	list_for_each_entry(client, &client_list, list) {
-		if (!client->agent)
-			continue;
+/* The event reports the state of the address, it is OFF once the last
+ * connection from the agent goes away.
+ */
+static void og_events_client(struct in_addr addr)
+{
+	const struct og_client *cli;
+	char buf[128];
+	int len;
 
-		object = json_object();
-		if (!object) {
-			json_decref(array);
-			return -1;
-		}
-		addr = json_string(inet_ntoa(client->addr.sin_addr));
-		if (!addr) {
-			json_decref(object);
-			json_decref(array);
-			return -1;
-		}
-		json_object_set_new(object, "addr", addr);
-		state = json_string(og_client_status(client));
-		if (!state) {
-			json_decref(object);
-			json_decref(array);
-			return -1;
-		}
-		json_object_set_new(object, "state", state);
-		json_array_append_new(array, object);
-	}
-	root = json_pack("{s:o}", "clients", array);
-	if (!root) {
-		json_decref(array);
+	if (!og_events_users)
+		return;
+
+	cli = og_client_find_addr(addr);
+	len = snprintf(buf, sizeof(buf),
+		       "event: client\n"
+		       "data: {\"addr\": \"%s\", \"state\": \"%s\"}\n\n",
+		       inet_ntoa(addr), cli ? og_client_status(cli) : "OFF");
+
+	og_events_broadcast(buf, len);
+}
+
+static void og_events_heartbeat_cb(struct ev_loop *loop, ev_timer *timer,
+				   int events)
+{
+	const char *ping = ": ping\n\n";
+
+	og_events_broadcast(ping, strlen(ping));
+}
+
+static int og_cmd_get_clients_events(json_t *element,
+				     struct og_msg_params *params,
+				     struct og_client *cli)
+{
+	struct og_stream *stream;
+
+	stream = og_stream_new(cli, OG_STREAM_EVENTS, NULL);
+	if (!stream)
 		return -1;
-	}
 
-	json_dump_callback(root, og_json_dump_clients, &og_buffer, 0);
-	json_decref(root);
+	stream->events.cli = cli;
+
+	if (!og_events_users++) {
+		ev_timer_init(&og_events_timer, og_events_heartbeat_cb,
+			      OG_EVENTS_HEARTBEAT, OG_EVENTS_HEARTBEAT);
+		ev_timer_start(og_loop, &og_events_timer);
+	}
 
 	return 0;
 }
@@ -509,11 +1998,17 @@ static int og_json_parse_target(json_t *element, struct og_msg_params *params)
 		}
 	}
 
+	/* Flags are checked over the whole array, each target needs both. */
+	if (!params->ips_array[params->ips_array_len] ||
+	    !params->mac_array[params->ips_array_len])
+		return -1;
+
 	return 0;
 }
 
-static int og_json_parse_targets(json_t *element, struct og_msg_params *params)
+static int og_json_parse_targets(json_t *element, void *base)
 {
+	struct og_msg_params *params = base;
 	unsigned int i;
 	json_t *k;
 	int err;
@@ -521,6 +2016,9 @@ static int og_json_parse_targets(json_t *element, struct og_msg_params *params)
 	if (json_typeof(element) != JSON_ARRAY)
 		return -1;
 
+	if (og_msg_params_grow(params, json_array_size(element)) < 0)
+		return -1;
+
 	for (i = 0; i < json_array_size(element); i++) {
 		k = json_array_get(element, i);
 
@@ -536,8 +2034,9 @@ static int og_json_parse_targets(json_t *element, struct og_msg_params *params)
 	return 0;
 }
 
-static int og_json_parse_type(json_t *element, struct og_msg_params *params)
+static int og_json_parse_type(json_t *element, void *base)
 {
+	struct og_msg_params *params = base;
 	const char *type;
 
 	if (json_typeof(element) != JSON_STRING)
@@ -553,125 +2052,120 @@ static int og_json_parse_type(json_t *element, struct og_msg_params *params)
 
 	params->flags |= OG_REST_PARAM_WOL_TYPE;
 
-	return 0;
-}
+	return 0;
+}
+
+/* The WoL request uses clients and type in a different way, hence its own table. */
+#define OG_REST_WOL_PARAMS(X)									\
+	X("clients",	FUNC,	ips_array,	OG_REST_PARAM_ADDR | OG_REST_PARAM_MAC,	og_json_parse_targets)	\
+	X("type",	FUNC,	wol_type,	OG_REST_PARAM_WOL_TYPE,			og_json_parse_type)
+
+static const struct og_json_param og_rest_wol_param[] = {
+#define X(...)	OG_JSON_PARAM(struct og_msg_params, __VA_ARGS__)
+	OG_REST_WOL_PARAMS(X)
+#undef X
+};
+
+static struct og_json_params og_rest_wol_params =
+	OG_JSON_PARAMS_INIT(og_rest_wol_param);
 
 static int og_cmd_wol(json_t *element, struct og_msg_params *params)
 {
-	const char *key;
-	json_t *value;
-	int err = 0;
+	const uint64_t required = 0 OG_REST_WOL_PARAMS(OG_JSON_PARAM_FLAG);
+	struct og_wol_target *targets;
+	unsigned int i;
 
-	if (json_typeof(element) != JSON_OBJECT)
+	if (og_json_parse_params(element, &og_rest_wol_params, params,
+				 &params->flags, required) < 0 ||
+	    !og_msg_params_validate(params, required))
 		return -1;
 
-	json_object_foreach(element, key, value) {
-		if (!strcmp(key, "clients")) {
-			err = og_json_parse_targets(value, params);
-		} else if (!strcmp(key, "type")) {
-			err = og_json_parse_type(value, params);
-		}
+	targets = og_arena_alloc(params->arena,
+				 params->ips_array_len * sizeof(*targets));
+	if (!targets)
+		return -1;
 
-		if (err < 0)
-			break;
+	for (i = 0; i < params->ips_array_len; i++) {
+		if (og_wol_target_init(&targets[i], params->ips_array[i],
+				       params->mac_array[i],
+				       atoi(params->wol_type)) < 0)
+			return -1;
 	}
 
-	if (!og_msg_params_validate(params, OG_REST_PARAM_ADDR |
-					    OG_REST_PARAM_MAC |
-					    OG_REST_PARAM_WOL_TYPE))
-		return -1;
+	/* Clients whose agent is already running do not need to wake up. */
+	for (i = 0; i < params->ips_array_len; i++) {
+		if (og_client_find_addr(targets[i].addr))
+			continue;
 
-	if (!Levanta((char **)params->ips_array, (char **)params->mac_array,
-		     params->ips_array_len, (char *)params->wol_type))
-		return -1;
+		if (og_wol_wake(&targets[i], 0) < 0)
+			return -1;
+	}
 
 	return 0;
 }
 
-static int og_json_parse_run(json_t *element, struct og_msg_params *params)
+static int og_cmd_wol_status(json_t *element, struct og_msg_params *params,
+			     struct og_buffer *og_buffer)
 {
-	if (json_typeof(element) != JSON_STRING)
-		return -1;
+	json_t *root;
 
-	snprintf(params->run_cmd, sizeof(params->run_cmd), "%s",
-		 json_string_value(element));
+	root = og_wol_status();
+	if (!root)
+		return -1;
 
-	params->flags |= OG_REST_PARAM_RUN_CMD;
+	if (json_dump_callback(root, og_json_dump_clients, og_buffer, 0)) {
+		json_decref(root);
+		return -1;
+	}
+	json_decref(root);
 
 	return 0;
 }
 
 static int og_cmd_run_post(json_t *element, struct og_msg_params *params)
 {
-	json_t *value, *clients;
-	const char *key;
+	struct og_agent *agent;
+	struct in_addr addr;
 	unsigned int i;
 	int err = 0;
 
-	if (json_typeof(element) != JSON_OBJECT)
+	if (og_msg_params_parse(element, params, OG_REST_PARAM_ADDR |
+						OG_REST_PARAM_RUN_CMD |
+						OG_REST_PARAM_ECHO) < 0)
 		return -1;
 
-	json_object_foreach(element, key, value) {
-		if (!strcmp(key, "clients"))
-			err = og_json_parse_clients(value, params);
-		else if (!strcmp(key, "run"))
-			err = og_json_parse_run(value, params);
-		else if (!strcmp(key, "echo")) {
-			err = og_json_parse_bool(value, &params->echo);
-			params->flags |= OG_REST_PARAM_ECHO;
-		}
-
-		if (err < 0)
-			break;
-	}
-
-	if (!og_msg_params_validate(params, OG_REST_PARAM_ADDR |
-					    OG_REST_PARAM_RUN_CMD |
-					    OG_REST_PARAM_ECHO))
-		return -1;
-
-	clients = json_copy(element);
-	json_object_del(clients, "clients");
-
-	err = og_send_request(OG_METHOD_POST, OG_CMD_SHELL_RUN, params, clients);
+	err = og_send_request_payload(OG_METHOD_POST, OG_CMD_SHELL_RUN,
+				      params, element);
 	if (err < 0)
 		return err;
 
+	/* Forget the output of the previous command. */
 	for (i = 0; i < params->ips_array_len; i++) {
-		char filename[4096];
-		FILE *f;
+		if (!inet_aton(params->ips_array[i], &addr))
+			continue;
+
+		agent = og_agent_lookup(addr, false);
+		if (!agent)
+			continue;
 
-		sprintf(filename, "/tmp/_Seconsola_%s", params->ips_array[i]);
-		f = fopen(filename, "wt");
-		fclose(f);
+		og_agent_output_set(agent, NULL, 0);
+		og_agent_put(agent);
 	}
 
 	return 0;
 }
 
 static int og_cmd_run_get(json_t *element, struct og_msg_params *params,
-			  char *buffer_reply)
+			  struct og_buffer *og_buffer)
 {
-	struct og_buffer og_buffer = {
-		.data	= buffer_reply,
-	};
-	json_t *root, *value, *array;
-	const char *key;
+	const struct og_agent *agent;
+	json_t *root, *array, *object;
+	const char *output;
+	struct in_addr addr;
+	uint32_t seq;
 	unsigned int i;
-	int err = 0;
-
-	if (json_typeof(element) != JSON_OBJECT)
-		return -1;
-
-	json_object_foreach(element, key, value) {
-		if (!strcmp(key, "clients"))
-			err = og_json_parse_clients(value, params);
-
-		if (err < 0)
-			return err;
-	}
 
-	if (!og_msg_params_validate(params, OG_REST_PARAM_ADDR))
+	if (og_msg_params_parse(element, params, OG_REST_PARAM_ADDR) < 0)
 		return -1;
 
 	array = json_array();
@@ -679,46 +2173,23 @@ static int og_cmd_run_get(json_t *element, struct og_msg_params *params,
 		return -1;
 
 	for (i = 0; i < params->ips_array_len; i++) {
-		json_t *object, *output, *addr;
-		char data[4096] = {};
-		char filename[4096];
-		int fd, numbytes;
-
-		sprintf(filename, "/tmp/_Seconsola_%s", params->ips_array[i]);
-
-		fd = open(filename, O_RDONLY);
-		if (!fd)
-			return -1;
-
-		numbytes = read(fd, data, sizeof(data));
-		if (numbytes < 0) {
-			close(fd);
-			return -1;
-		}
-		data[sizeof(data) - 1] = '\0';
-		close(fd);
-
-		object = json_object();
-		if (!object) {
-			json_decref(array);
-			return -1;
-		}
-		addr = json_string(params->ips_array[i]);
-		if (!addr) {
-			json_decref(object);
+		if (!inet_aton(params->ips_array[i], &addr)) {
 			json_decref(array);
 			return -1;
 		}
-		json_object_set_new(object, "addr", addr);
 
-		output = json_string(data);
-		if (!output) {
-			json_decref(object);
+		agent = og_agent_lookup(addr, false);
+		output = agent && agent->output ? agent->output : "";
+		seq = agent ? agent->output_seq : 0;
+
+		object = json_pack("{s:s, s:s, s:I}",
+				   "addr", params->ips_array[i],
+				   "output", output,
+				   "seq", (json_int_t)seq);
+		if (!object) {
 			json_decref(array);
 			return -1;
 		}
-		json_object_set_new(object, "output", output);
-
 		json_array_append_new(array, object);
 	}
 
@@ -726,7 +2197,10 @@ static int og_cmd_run_get(json_t *element, struct og_msg_params *params,
 	if (!root)
 		return -1;
 
-	json_dump_callback(root, og_json_dump_clients, &og_buffer, 0);
+	if (json_dump_callback(root, og_json_dump_clients, og_buffer, 0)) {
+		json_decref(root);
+		return -1;
+	}
 	json_decref(root);
 
 	return 0;
@@ -734,57 +2208,18 @@ static int og_cmd_run_get(json_t *element, struct og_msg_params *params,
 
 static int og_cmd_session(json_t *element, struct og_msg_params *params)
 {
-	json_t *clients, *value;
-	const char *key;
-	int err = 0;
-
-	if (json_typeof(element) != JSON_OBJECT)
-		return -1;
-
-	json_object_foreach(element, key, value) {
-		if (!strcmp(key, "clients")) {
-			err = og_json_parse_clients(value, params);
-		} else if (!strcmp(key, "disk")) {
-			err = og_json_parse_string(value, &params->disk);
-			params->flags |= OG_REST_PARAM_DISK;
-		} else if (!strcmp(key, "partition")) {
-			err = og_json_parse_string(value, &params->partition);
-			params->flags |= OG_REST_PARAM_PARTITION;
-		}
-
-		if (err < 0)
-			return err;
-	}
-
-	if (!og_msg_params_validate(params, OG_REST_PARAM_ADDR |
-					    OG_REST_PARAM_DISK |
-					    OG_REST_PARAM_PARTITION))
+	if (og_msg_params_parse(element, params, OG_REST_PARAM_ADDR |
+						OG_REST_PARAM_DISK |
+						OG_REST_PARAM_PARTITION) < 0)
 		return -1;
 
-	clients = json_copy(element);
-	json_object_del(clients, "clients");
-
-	return og_send_request(OG_METHOD_POST, OG_CMD_SESSION, params, clients);
+	return og_send_request_payload(OG_METHOD_POST, OG_CMD_SESSION,
+				       params, element);
 }
 
 static int og_cmd_poweroff(json_t *element, struct og_msg_params *params)
 {
-	const char *key;
-	json_t *value;
-	int err = 0;
-
-	if (json_typeof(element) != JSON_OBJECT)
-		return -1;
-
-	json_object_foreach(element, key, value) {
-		if (!strcmp(key, "clients"))
-			err = og_json_parse_clients(value, params);
-
-		if (err < 0)
-			break;
-	}
-
-	if (!og_msg_params_validate(params, OG_REST_PARAM_ADDR))
+	if (og_msg_params_parse(element, params, OG_REST_PARAM_ADDR) < 0)
 		return -1;
 
 	return og_send_request(OG_METHOD_POST, OG_CMD_POWEROFF, params, NULL);
@@ -792,22 +2227,7 @@ static int og_cmd_poweroff(json_t *element, struct og_msg_params *params)
 
 static int og_cmd_refresh(json_t *element, struct og_msg_params *params)
 {
-	const char *key;
-	json_t *value;
-	int err = 0;
-
-	if (json_typeof(element) != JSON_OBJECT)
-		return -1;
-
-	json_object_foreach(element, key, value) {
-		if (!strcmp(key, "clients"))
-			err = og_json_parse_clients(value, params);
-
-		if (err < 0)
-			break;
-	}
-
-	if (!og_msg_params_validate(params, OG_REST_PARAM_ADDR))
+	if (og_msg_params_parse(element, params, OG_REST_PARAM_ADDR) < 0)
 		return -1;
 
 	return og_send_request(OG_METHOD_GET, OG_CMD_REFRESH, params, NULL);
@@ -815,22 +2235,7 @@ static int og_cmd_refresh(json_t *element, struct og_msg_params *params)
 
 static int og_cmd_reboot(json_t *element, struct og_msg_params *params)
 {
-	const char *key;
-	json_t *value;
-	int err = 0;
-
-	if (json_typeof(element) != JSON_OBJECT)
-		return -1;
-
-	json_object_foreach(element, key, value) {
-		if (!strcmp(key, "clients"))
-			err = og_json_parse_clients(value, params);
-
-		if (err < 0)
-			break;
-	}
-
-	if (!og_msg_params_validate(params, OG_REST_PARAM_ADDR))
+	if (og_msg_params_parse(element, params, OG_REST_PARAM_ADDR) < 0)
 		return -1;
 
 	return og_send_request(OG_METHOD_POST, OG_CMD_REBOOT, params, NULL);
@@ -838,22 +2243,7 @@ static int og_cmd_reboot(json_t *element, struct og_msg_params *params)
 
 static int og_cmd_stop(json_t *element, struct og_msg_params *params)
 {
-	const char *key;
-	json_t *value;
-	int err = 0;
-
-	if (json_typeof(element) != JSON_OBJECT)
-		return -1;
-
-	json_object_foreach(element, key, value) {
-		if (!strcmp(key, "clients"))
-			err = og_json_parse_clients(value, params);
-
-		if (err < 0)
-			break;
-	}
-
-	if (!og_msg_params_validate(params, OG_REST_PARAM_ADDR))
+	if (og_msg_params_parse(element, params, OG_REST_PARAM_ADDR) < 0)
 		return -1;
 
 	return og_send_request(OG_METHOD_POST, OG_CMD_STOP, params, NULL);
@@ -861,22 +2251,7 @@ static int og_cmd_stop(json_t *element, struct og_msg_params *params)
 
 static int og_cmd_hardware(json_t *element, struct og_msg_params *params)
 {
-	const char *key;
-	json_t *value;
-	int err = 0;
-
-	if (json_typeof(element) != JSON_OBJECT)
-		return -1;
-
-	json_object_foreach(element, key, value) {
-		if (!strcmp(key, "clients"))
-			err = og_json_parse_clients(value, params);
-
-		if (err < 0)
-			break;
-	}
-
-	if (!og_msg_params_validate(params, OG_REST_PARAM_ADDR))
+	if (og_msg_params_parse(element, params, OG_REST_PARAM_ADDR) < 0)
 		return -1;
 
 	return og_send_request(OG_METHOD_GET, OG_CMD_HARDWARE, params, NULL);
@@ -884,208 +2259,65 @@ static int og_cmd_hardware(json_t *element, struct og_msg_params *params)
 
 static int og_cmd_software(json_t *element, struct og_msg_params *params)
 {
-	json_t *clients, *value;
-	const char *key;
-	int err = 0;
-
-	if (json_typeof(element) != JSON_OBJECT)
-		return -1;
-
-	json_object_foreach(element, key, value) {
-		if (!strcmp(key, "clients"))
-			err = og_json_parse_clients(value, params);
-		else if (!strcmp(key, "disk")) {
-			err = og_json_parse_string(value, &params->disk);
-			params->flags |= OG_REST_PARAM_DISK;
-		}
-		else if (!strcmp(key, "partition")) {
-			err = og_json_parse_string(value, &params->partition);
-			params->flags |= OG_REST_PARAM_PARTITION;
-		}
-
-		if (err < 0)
-			break;
-	}
-
-	if (!og_msg_params_validate(params, OG_REST_PARAM_ADDR |
-					    OG_REST_PARAM_DISK |
-					    OG_REST_PARAM_PARTITION))
+	if (og_msg_params_parse(element, params, OG_REST_PARAM_ADDR |
+						OG_REST_PARAM_DISK |
+						OG_REST_PARAM_PARTITION) < 0)
 		return -1;
 
-	clients = json_copy(element);
-	json_object_del(clients, "clients");
-
-	return og_send_request(OG_METHOD_POST, OG_CMD_SOFTWARE, params, clients);
+	return og_send_request_payload(OG_METHOD_POST, OG_CMD_SOFTWARE,
+				       params, element);
 }
 
 static int og_cmd_create_image(json_t *element, struct og_msg_params *params)
 {
-	json_t *value, *clients;
-	const char *key;
-	int err = 0;
-
-	if (json_typeof(element) != JSON_OBJECT)
-		return -1;
-
-	json_object_foreach(element, key, value) {
-		if (!strcmp(key, "disk")) {
-			err = og_json_parse_string(value, &params->disk);
-			params->flags |= OG_REST_PARAM_DISK;
-		} else if (!strcmp(key, "partition")) {
-			err = og_json_parse_string(value, &params->partition);
-			params->flags |= OG_REST_PARAM_PARTITION;
-		} else if (!strcmp(key, "name")) {
-			err = og_json_parse_string(value, &params->name);
-			params->flags |= OG_REST_PARAM_NAME;
-		} else if (!strcmp(key, "repository")) {
-			err = og_json_parse_string(value, &params->repository);
-			params->flags |= OG_REST_PARAM_REPO;
-		} else if (!strcmp(key, "clients")) {
-			err = og_json_parse_clients(value, params);
-		} else if (!strcmp(key, "id")) {
-			err = og_json_parse_string(value, &params->id);
-			params->flags |= OG_REST_PARAM_ID;
-		} else if (!strcmp(key, "code")) {
-			err = og_json_parse_string(value, &params->code);
-			params->flags |= OG_REST_PARAM_CODE;
-		}
-
-		if (err < 0)
-			break;
-	}
-
-	if (!og_msg_params_validate(params, OG_REST_PARAM_ADDR |
-					    OG_REST_PARAM_DISK |
-					    OG_REST_PARAM_PARTITION |
-					    OG_REST_PARAM_CODE |
-					    OG_REST_PARAM_ID |
-					    OG_REST_PARAM_NAME |
-					    OG_REST_PARAM_REPO))
+	if (og_msg_params_parse(element, params, OG_REST_PARAM_ADDR |
+						OG_REST_PARAM_DISK |
+						OG_REST_PARAM_PARTITION |
+						OG_REST_PARAM_CODE |
+						OG_REST_PARAM_ID |
+						OG_REST_PARAM_NAME |
+						OG_REST_PARAM_REPO) < 0)
 		return -1;
 
-	clients = json_copy(element);
-	json_object_del(clients, "clients");
-
-	return og_send_request(OG_METHOD_POST, OG_CMD_IMAGE_CREATE, params,
-			       clients);
+	return og_send_request_payload(OG_METHOD_POST, OG_CMD_IMAGE_CREATE,
+				       params, element);
 }
 
 static int og_cmd_restore_image(json_t *element, struct og_msg_params *params)
 {
-	json_t *clients, *value;
-	const char *key;
-	int err = 0;
-
-	if (json_typeof(element) != JSON_OBJECT)
-		return -1;
-
-	json_object_foreach(element, key, value) {
-		if (!strcmp(key, "disk")) {
-			err = og_json_parse_string(value, &params->disk);
-			params->flags |= OG_REST_PARAM_DISK;
-		} else if (!strcmp(key, "partition")) {
-			err = og_json_parse_string(value, &params->partition);
-			params->flags |= OG_REST_PARAM_PARTITION;
-		} else if (!strcmp(key, "name")) {
-			err = og_json_parse_string(value, &params->name);
-			params->flags |= OG_REST_PARAM_NAME;
-		} else if (!strcmp(key, "repository")) {
-			err = og_json_parse_string(value, &params->repository);
-			params->flags |= OG_REST_PARAM_REPO;
-		} else if (!strcmp(key, "clients")) {
-			err = og_json_parse_clients(value, params);
-		} else if (!strcmp(key, "type")) {
-			err = og_json_parse_string(value, &params->type);
-			params->flags |= OG_REST_PARAM_TYPE;
-		} else if (!strcmp(key, "profile")) {
-			err = og_json_parse_string(value, &params->profile);
-			params->flags |= OG_REST_PARAM_PROFILE;
-		} else if (!strcmp(key, "id")) {
-			err = og_json_parse_string(value, &params->id);
-			params->flags |= OG_REST_PARAM_ID;
-		}
-
-		if (err < 0)
-			break;
-	}
-
-	if (!og_msg_params_validate(params, OG_REST_PARAM_ADDR |
-					    OG_REST_PARAM_DISK |
-					    OG_REST_PARAM_PARTITION |
-					    OG_REST_PARAM_NAME |
-					    OG_REST_PARAM_REPO |
-					    OG_REST_PARAM_TYPE |
-					    OG_REST_PARAM_PROFILE |
-					    OG_REST_PARAM_ID))
+	if (og_msg_params_parse(element, params, OG_REST_PARAM_ADDR |
+						OG_REST_PARAM_DISK |
+						OG_REST_PARAM_PARTITION |
+						OG_REST_PARAM_NAME |
+						OG_REST_PARAM_REPO |
+						OG_REST_PARAM_TYPE |
+						OG_REST_PARAM_PROFILE |
+						OG_REST_PARAM_ID) < 0)
 		return -1;
 
-	clients = json_copy(element);
-	json_object_del(clients, "clients");
-
-	return og_send_request(OG_METHOD_POST, OG_CMD_IMAGE_RESTORE, params,
-			       clients);
+	return og_send_request_payload(OG_METHOD_POST, OG_CMD_IMAGE_RESTORE,
+				       params, element);
 }
 
 static int og_cmd_setup(json_t *element, struct og_msg_params *params)
 {
-	json_t *value, *clients;
-	const char *key;
-	int err = 0;
-
-	if (json_typeof(element) != JSON_OBJECT)
-		return -1;
-
-	json_object_foreach(element, key, value) {
-		if (!strcmp(key, "clients")) {
-			err = og_json_parse_clients(value, params);
-		} else if (!strcmp(key, "disk")) {
-			err = og_json_parse_string(value, &params->disk);
-			params->flags |= OG_REST_PARAM_DISK;
-		} else if (!strcmp(key, "cache")) {
-			err = og_json_parse_string(value, &params->cache);
-			params->flags |= OG_REST_PARAM_CACHE;
-		} else if (!strcmp(key, "cache_size")) {
-			err = og_json_parse_string(value, &params->cache_size);
-			params->flags |= OG_REST_PARAM_CACHE_SIZE;
-		} else if (!strcmp(key, "partition_setup")) {
-			err = og_json_parse_partition_setup(value, params);
-		}
-
-		if (err < 0)
-			break;
-	}
-
-	if (!og_msg_params_validate(params, OG_REST_PARAM_ADDR |
-					    OG_REST_PARAM_DISK |
-					    OG_REST_PARAM_CACHE |
-					    OG_REST_PARAM_CACHE_SIZE |
-					    OG_REST_PARAM_PART_0 |
-					    OG_REST_PARAM_PART_1 |
-					    OG_REST_PARAM_PART_2 |
-					    OG_REST_PARAM_PART_3))
+	if (og_msg_params_parse(element, params, OG_REST_PARAM_ADDR |
+						OG_REST_PARAM_DISK |
+						OG_REST_PARAM_CACHE |
+						OG_REST_PARAM_CACHE_SIZE |
+						OG_REST_PARAM_PART_0 |
+						OG_REST_PARAM_PART_1 |
+						OG_REST_PARAM_PART_2 |
+						OG_REST_PARAM_PART_3) < 0)
 		return -1;
 
-	clients = json_copy(element);
-	json_object_del(clients, "clients");
-
-	return og_send_request(OG_METHOD_POST, OG_CMD_SETUP, params, clients);
+	return og_send_request_payload(OG_METHOD_POST, OG_CMD_SETUP,
+				       params, element);
 }
 
 static int og_cmd_run_schedule(json_t *element, struct og_msg_params *params)
 {
-	const char *key;
-	json_t *value;
-	int err = 0;
-
-	json_object_foreach(element, key, value) {
-		if (!strcmp(key, "clients"))
-			err = og_json_parse_clients(value, params);
-
-		if (err < 0)
-			break;
-	}
-
-	if (!og_msg_params_validate(params, OG_REST_PARAM_ADDR))
+	if (og_msg_params_parse(element, params, OG_REST_PARAM_ADDR) < 0)
 		return -1;
 
 	return og_send_request(OG_METHOD_GET, OG_CMD_RUN_SCHEDULE, params,
@@ -1095,58 +2327,24 @@ static int og_cmd_run_schedule(json_t *element, struct og_msg_params *params)
 static int og_cmd_create_basic_image(json_t *element, struct og_msg_params *params)
 {
 	char buf[4096] = {};
-	int err = 0, len;
-	const char *key;
-	json_t *value;
+	int len;
 	TRAMA *msg;
 
-	if (json_typeof(element) != JSON_OBJECT)
-		return -1;
-
-	json_object_foreach(element, key, value) {
-		if (!strcmp(key, "clients")) {
-			err = og_json_parse_clients(value, params);
-		} else if (!strcmp(key, "disk")) {
-			err = og_json_parse_string(value, &params->disk);
-			params->flags |= OG_REST_PARAM_DISK;
-		} else if (!strcmp(key, "partition")) {
-			err = og_json_parse_string(value, &params->partition);
-			params->flags |= OG_REST_PARAM_PARTITION;
-		} else if (!strcmp(key, "code")) {
-			err = og_json_parse_string(value, &params->code);
-			params->flags |= OG_REST_PARAM_CODE;
-		} else if (!strcmp(key, "id")) {
-			err = og_json_parse_string(value, &params->id);
-			params->flags |= OG_REST_PARAM_ID;
-		} else if (!strcmp(key, "name")) {
-			err = og_json_parse_string(value, &params->name);
-			params->flags |= OG_REST_PARAM_NAME;
-		} else if (!strcmp(key, "repository")) {
-			err = og_json_parse_string(value, &params->repository);
-			params->flags |= OG_REST_PARAM_REPO;
-		} else if (!strcmp(key, "sync_params")) {
-			err = og_json_parse_sync_params(value, params);
-		}
-
-		if (err < 0)
-			break;
-	}
-
-	if (!og_msg_params_validate(params, OG_REST_PARAM_ADDR |
-					    OG_REST_PARAM_DISK |
-					    OG_REST_PARAM_PARTITION |
-					    OG_REST_PARAM_CODE |
-					    OG_REST_PARAM_ID |
-					    OG_REST_PARAM_NAME |
-					    OG_REST_PARAM_REPO |
-					    OG_REST_PARAM_SYNC_SYNC |
-					    OG_REST_PARAM_SYNC_DIFF |
-					    OG_REST_PARAM_SYNC_REMOVE |
-					    OG_REST_PARAM_SYNC_COMPRESS |
-					    OG_REST_PARAM_SYNC_CLEANUP |
-					    OG_REST_PARAM_SYNC_CACHE |
-					    OG_REST_PARAM_SYNC_CLEANUP_CACHE |
-					    OG_REST_PARAM_SYNC_REMOVE_DST))
+	if (og_msg_params_parse(element, params, OG_REST_PARAM_ADDR |
+						OG_REST_PARAM_DISK |
+						OG_REST_PARAM_PARTITION |
+						OG_REST_PARAM_CODE |
+						OG_REST_PARAM_ID |
+						OG_REST_PARAM_NAME |
+						OG_REST_PARAM_REPO |
+						OG_REST_PARAM_SYNC_SYNC |
+						OG_REST_PARAM_SYNC_DIFF |
+						OG_REST_PARAM_SYNC_REMOVE |
+						OG_REST_PARAM_SYNC_COMPRESS |
+						OG_REST_PARAM_SYNC_CLEANUP |
+						OG_REST_PARAM_SYNC_CACHE |
+						OG_REST_PARAM_SYNC_CLEANUP_CACHE |
+						OG_REST_PARAM_SYNC_REMOVE_DST) < 0)
 		return -1;
 
 	len = snprintf(buf, sizeof(buf),
@@ -1175,57 +2373,26 @@ static int og_cmd_create_basic_image(json_t *element, struct og_msg_params *para
 static int og_cmd_create_incremental_image(json_t *element, struct og_msg_params *params)
 {
 	char buf[4096] = {};
-	int err = 0, len;
-	const char *key;
-	json_t *value;
+	int len;
 	TRAMA *msg;
 
-	if (json_typeof(element) != JSON_OBJECT)
-		return -1;
-
-	json_object_foreach(element, key, value) {
-		if (!strcmp(key, "clients"))
-			err = og_json_parse_clients(value, params);
-		else if (!strcmp(key, "disk")) {
-			err = og_json_parse_string(value, &params->disk);
-			params->flags |= OG_REST_PARAM_DISK;
-		} else if (!strcmp(key, "partition")) {
-			err = og_json_parse_string(value, &params->partition);
-			params->flags |= OG_REST_PARAM_PARTITION;
-		} else if (!strcmp(key, "id")) {
-			err = og_json_parse_string(value, &params->id);
-			params->flags |= OG_REST_PARAM_ID;
-		} else if (!strcmp(key, "name")) {
-			err = og_json_parse_string(value, &params->name);
-			params->flags |= OG_REST_PARAM_NAME;
-		} else if (!strcmp(key, "repository")) {
-			err = og_json_parse_string(value, &params->repository);
-			params->flags |= OG_REST_PARAM_REPO;
-		} else if (!strcmp(key, "sync_params")) {
-			err = og_json_parse_sync_params(value, params);
-		}
-
-		if (err < 0)
-			break;
-	}
-
-	if (!og_msg_params_validate(params, OG_REST_PARAM_ADDR |
-					    OG_REST_PARAM_DISK |
-					    OG_REST_PARAM_PARTITION |
-					    OG_REST_PARAM_ID |
-					    OG_REST_PARAM_NAME |
-					    OG_REST_PARAM_REPO |
-					    OG_REST_PARAM_SYNC_SYNC |
-					    OG_REST_PARAM_SYNC_PATH |
-					    OG_REST_PARAM_SYNC_DIFF |
-					    OG_REST_PARAM_SYNC_DIFF_ID |
-					    OG_REST_PARAM_SYNC_DIFF_NAME |
-					    OG_REST_PARAM_SYNC_REMOVE |
-					    OG_REST_PARAM_SYNC_COMPRESS |
-					    OG_REST_PARAM_SYNC_CLEANUP |
-					    OG_REST_PARAM_SYNC_CACHE |
-					    OG_REST_PARAM_SYNC_CLEANUP_CACHE |
-					    OG_REST_PARAM_SYNC_REMOVE_DST))
+	if (og_msg_params_parse(element, params, OG_REST_PARAM_ADDR |
+						OG_REST_PARAM_DISK |
+						OG_REST_PARAM_PARTITION |
+						OG_REST_PARAM_ID |
+						OG_REST_PARAM_NAME |
+						OG_REST_PARAM_REPO |
+						OG_REST_PARAM_SYNC_SYNC |
+						OG_REST_PARAM_SYNC_PATH |
+						OG_REST_PARAM_SYNC_DIFF |
+						OG_REST_PARAM_SYNC_DIFF_ID |
+						OG_REST_PARAM_SYNC_DIFF_NAME |
+						OG_REST_PARAM_SYNC_REMOVE |
+						OG_REST_PARAM_SYNC_COMPRESS |
+						OG_REST_PARAM_SYNC_CLEANUP |
+						OG_REST_PARAM_SYNC_CACHE |
+						OG_REST_PARAM_SYNC_CLEANUP_CACHE |
+						OG_REST_PARAM_SYNC_REMOVE_DST) < 0)
 		return -1;
 
 	len = snprintf(buf, sizeof(buf),
@@ -1255,64 +2422,27 @@ static int og_cmd_create_incremental_image(json_t *element, struct og_msg_params
 static int og_cmd_restore_basic_image(json_t *element, struct og_msg_params *params)
 {
 	char buf[4096] = {};
-	int err = 0, len;
-	const char *key;
-	json_t *value;
+	int len;
 	TRAMA *msg;
 
-	if (json_typeof(element) != JSON_OBJECT)
-		return -1;
-
-	json_object_foreach(element, key, value) {
-		if (!strcmp(key, "clients")) {
-			err = og_json_parse_clients(value, params);
-		} else if (!strcmp(key, "disk")) {
-			err = og_json_parse_string(value, &params->disk);
-			params->flags |= OG_REST_PARAM_DISK;
-		} else if (!strcmp(key, "partition")) {
-			err = og_json_parse_string(value, &params->partition);
-			params->flags |= OG_REST_PARAM_PARTITION;
-		} else if (!strcmp(key, "id")) {
-			err = og_json_parse_string(value, &params->id);
-			params->flags |= OG_REST_PARAM_ID;
-		} else if (!strcmp(key, "name")) {
-			err = og_json_parse_string(value, &params->name);
-			params->flags |= OG_REST_PARAM_NAME;
-		} else if (!strcmp(key, "repository")) {
-			err = og_json_parse_string(value, &params->repository);
-			params->flags |= OG_REST_PARAM_REPO;
-		} else if (!strcmp(key, "profile")) {
-			err = og_json_parse_string(value, &params->profile);
-			params->flags |= OG_REST_PARAM_PROFILE;
-		} else if (!strcmp(key, "type")) {
-			err = og_json_parse_string(value, &params->type);
-			params->flags |= OG_REST_PARAM_TYPE;
-		} else if (!strcmp(key, "sync_params")) {
-			err = og_json_parse_sync_params(value, params);
-		}
-
-		if (err < 0)
-			break;
-	}
-
-	if (!og_msg_params_validate(params, OG_REST_PARAM_ADDR |
-					    OG_REST_PARAM_DISK |
-					    OG_REST_PARAM_PARTITION |
-					    OG_REST_PARAM_ID |
-					    OG_REST_PARAM_NAME |
-					    OG_REST_PARAM_REPO |
-					    OG_REST_PARAM_PROFILE |
-					    OG_REST_PARAM_TYPE |
-					    OG_REST_PARAM_SYNC_PATH |
-					    OG_REST_PARAM_SYNC_METHOD |
-					    OG_REST_PARAM_SYNC_SYNC |
-					    OG_REST_PARAM_SYNC_DIFF |
-					    OG_REST_PARAM_SYNC_REMOVE |
-					    OG_REST_PARAM_SYNC_COMPRESS |
-					    OG_REST_PARAM_SYNC_CLEANUP |
-					    OG_REST_PARAM_SYNC_CACHE |
-					    OG_REST_PARAM_SYNC_CLEANUP_CACHE |
-					    OG_REST_PARAM_SYNC_REMOVE_DST))
+	if (og_msg_params_parse(element, params, OG_REST_PARAM_ADDR |
+						OG_REST_PARAM_DISK |
+						OG_REST_PARAM_PARTITION |
+						OG_REST_PARAM_ID |
+						OG_REST_PARAM_NAME |
+						OG_REST_PARAM_REPO |
+						OG_REST_PARAM_PROFILE |
+						OG_REST_PARAM_TYPE |
+						OG_REST_PARAM_SYNC_PATH |
+						OG_REST_PARAM_SYNC_METHOD |
+						OG_REST_PARAM_SYNC_SYNC |
+						OG_REST_PARAM_SYNC_DIFF |
+						OG_REST_PARAM_SYNC_REMOVE |
+						OG_REST_PARAM_SYNC_COMPRESS |
+						OG_REST_PARAM_SYNC_CLEANUP |
+						OG_REST_PARAM_SYNC_CACHE |
+						OG_REST_PARAM_SYNC_CLEANUP_CACHE |
+						OG_REST_PARAM_SYNC_REMOVE_DST) < 0)
 		return -1;
 
 	len = snprintf(buf, sizeof(buf),
@@ -1342,66 +2472,29 @@ static int og_cmd_restore_basic_image(json_t *element, struct og_msg_params *par
 static int og_cmd_restore_incremental_image(json_t *element, struct og_msg_params *params)
 {
 	char buf[4096] = {};
-	int err = 0, len;
-	const char *key;
-	json_t *value;
-	TRAMA *msg;
-
-	if (json_typeof(element) != JSON_OBJECT)
-		return -1;
-
-	json_object_foreach(element, key, value) {
-		if (!strcmp(key, "clients")) {
-			err = og_json_parse_clients(value, params);
-		} else if (!strcmp(key, "disk")) {
-			err = og_json_parse_string(value, &params->disk);
-			params->flags |= OG_REST_PARAM_DISK;
-		} else if (!strcmp(key, "partition")) {
-			err = og_json_parse_string(value, &params->partition);
-			params->flags |= OG_REST_PARAM_PARTITION;
-		} else if (!strcmp(key, "id")) {
-			err = og_json_parse_string(value, &params->id);
-			params->flags |= OG_REST_PARAM_ID;
-		} else if (!strcmp(key, "name")) {
-			err = og_json_parse_string(value, &params->name);
-			params->flags |= OG_REST_PARAM_NAME;
-		} else if (!strcmp(key, "repository")) {
-			err = og_json_parse_string(value, &params->repository);
-			params->flags |= OG_REST_PARAM_REPO;
-		} else if (!strcmp(key, "profile")) {
-			err = og_json_parse_string(value, &params->profile);
-			params->flags |= OG_REST_PARAM_PROFILE;
-		} else if (!strcmp(key, "type")) {
-			err = og_json_parse_string(value, &params->type);
-			params->flags |= OG_REST_PARAM_TYPE;
-		} else if (!strcmp(key, "sync_params")) {
-			err = og_json_parse_sync_params(value, params);
-		}
-
-		if (err < 0)
-			break;
-	}
+	int len;
+	TRAMA *msg;
 
-	if (!og_msg_params_validate(params, OG_REST_PARAM_ADDR |
-					    OG_REST_PARAM_DISK |
-					    OG_REST_PARAM_PARTITION |
-					    OG_REST_PARAM_ID |
-					    OG_REST_PARAM_NAME |
-					    OG_REST_PARAM_REPO |
-					    OG_REST_PARAM_PROFILE |
-					    OG_REST_PARAM_TYPE |
-					    OG_REST_PARAM_SYNC_DIFF_ID |
-					    OG_REST_PARAM_SYNC_DIFF_NAME |
-					    OG_REST_PARAM_SYNC_PATH |
-					    OG_REST_PARAM_SYNC_METHOD |
-					    OG_REST_PARAM_SYNC_SYNC |
-					    OG_REST_PARAM_SYNC_DIFF |
-					    OG_REST_PARAM_SYNC_REMOVE |
-					    OG_REST_PARAM_SYNC_COMPRESS |
-					    OG_REST_PARAM_SYNC_CLEANUP |
-					    OG_REST_PARAM_SYNC_CACHE |
-					    OG_REST_PARAM_SYNC_CLEANUP_CACHE |
-					    OG_REST_PARAM_SYNC_REMOVE_DST))
+	if (og_msg_params_parse(element, params, OG_REST_PARAM_ADDR |
+						OG_REST_PARAM_DISK |
+						OG_REST_PARAM_PARTITION |
+						OG_REST_PARAM_ID |
+						OG_REST_PARAM_NAME |
+						OG_REST_PARAM_REPO |
+						OG_REST_PARAM_PROFILE |
+						OG_REST_PARAM_TYPE |
+						OG_REST_PARAM_SYNC_DIFF_ID |
+						OG_REST_PARAM_SYNC_DIFF_NAME |
+						OG_REST_PARAM_SYNC_PATH |
+						OG_REST_PARAM_SYNC_METHOD |
+						OG_REST_PARAM_SYNC_SYNC |
+						OG_REST_PARAM_SYNC_DIFF |
+						OG_REST_PARAM_SYNC_REMOVE |
+						OG_REST_PARAM_SYNC_COMPRESS |
+						OG_REST_PARAM_SYNC_CLEANUP |
+						OG_REST_PARAM_SYNC_CACHE |
+						OG_REST_PARAM_SYNC_CLEANUP_CACHE |
+						OG_REST_PARAM_SYNC_REMOVE_DST) < 0)
 		return -1;
 
 	len = snprintf(buf, sizeof(buf),
@@ -1430,50 +2523,79 @@ static int og_cmd_restore_incremental_image(json_t *element, struct og_msg_param
 	return 0;
 }
 
-static LIST_HEAD(cmd_list);
-
-const struct og_cmd *og_cmd_find(const char *client_ip)
+const struct og_cmd *og_cmd_find(struct in_addr addr)
 {
-	struct og_cmd *cmd, *next;
+	struct og_agent *agent;
+	struct og_cmd *cmd;
 
-	list_for_each_entry_safe(cmd, next, &cmd_list, list) {
-		if (strcmp(cmd->ip, client_ip))
-			continue;
+	agent = og_agent_lookup(addr, false);
+	if (!agent || list_empty(&agent->cmd_list))
+		return NULL;
 
-		list_del(&cmd->list);
-		return cmd;
-	}
+	cmd = list_first_entry(&agent->cmd_list, struct og_cmd, list);
+	list_del(&cmd->list);
+	og_agent_put(agent);
 
-	return NULL;
+	return cmd;
 }
 
-void og_cmd_free(const struct og_cmd *cmd)
+/* Appends this command to the queue of pending commands of its agent. */
+static void og_cmd_queue(struct og_cmd *cmd)
 {
-	struct og_msg_params *params = (struct og_msg_params *)&cmd->params;
-	int i;
+	struct og_agent *agent;
 
-	for (i = 0; i < params->ips_array_len; i++) {
-		free((void *)params->ips_array[i]);
-		free((void *)params->mac_array[i]);
+	agent = og_agent_lookup(cmd->addr, true);
+	if (!agent) {
+		syslog(LOG_ERR, "OOM while queueing command for %s\n",
+		       inet_ntoa(cmd->addr));
+		og_cmd_free(cmd);
+		return;
 	}
-	free((void *)params->wol_type);
+	list_add_tail(&cmd->list, &agent->cmd_list);
+}
 
-	if (cmd->json)
-		json_decref(cmd->json);
+static void og_cmd_payload_put(struct og_cmd_payload *payload)
+{
+	if (payload && --payload->refcnt == 0)
+		free(payload);
+}
 
-	free((void *)cmd->ip);
-	free((void *)cmd->mac);
+void og_cmd_free(const struct og_cmd *cmd)
+{
+	og_cmd_payload_put(cmd->payload);
 	free((void *)cmd);
 }
 
-static void og_cmd_init(struct og_cmd *cmd, enum og_rest_method method,
-			enum og_cmd_type type, json_t *root)
+/* Serializes the payload once, it is shared by every command that is queued
+ * from this template.
+ */
+static int og_cmd_init(struct og_cmd *cmd, enum og_rest_method method,
+		       enum og_cmd_type type, json_t *root)
 {
+	struct og_cmd_payload *payload;
+	size_t len;
+
 	cmd->type = type;
 	cmd->method = method;
-	cmd->params.ips_array[0] = strdup(cmd->ip);
-	cmd->params.ips_array_len = 1;
-	cmd->json = root;
+
+	if (!root)
+		return 0;
+
+	len = json_dumpb(root, NULL, 0, JSON_COMPACT);
+	payload = malloc(sizeof(struct og_cmd_payload) + len + 1);
+	if (!payload) {
+		json_decref(root);
+		return -1;
+	}
+	json_dumpb(root, payload->data, len, JSON_COMPACT);
+	payload->data[len] = '\0';
+	payload->len = len;
+	payload->refcnt = 1;
+	json_decref(root);
+
+	cmd->payload = payload;
+
+	return 0;
 }
 
 static int og_cmd_legacy_wol(const char *input, struct og_cmd *cmd)
@@ -1485,11 +2607,9 @@ static int og_cmd_legacy_wol(const char *input, struct og_cmd *cmd)
 		return -1;
 	}
 
-	og_cmd_init(cmd, OG_METHOD_NO_HTTP, OG_CMD_WOL, NULL);
-	cmd->params.mac_array[0] = strdup(cmd->mac);
-	cmd->params.wol_type = strdup(wol_type);
+	cmd->wol.type = atoi(wol_type);
 
-	return 0;
+	return og_cmd_init(cmd, OG_METHOD_NO_HTTP, OG_CMD_WOL, NULL);
 }
 
 static int og_cmd_legacy_shell_run(const char *input, struct og_cmd *cmd)
@@ -1505,9 +2625,7 @@ static int og_cmd_legacy_shell_run(const char *input, struct og_cmd *cmd)
 	json_object_set_new(root, "run", script);
 	json_object_set_new(root, "echo", echo);
 
-	og_cmd_init(cmd, OG_METHOD_POST, OG_CMD_SHELL_RUN, root);
-
-	return 0;
+	return og_cmd_init(cmd, OG_METHOD_POST, OG_CMD_SHELL_RUN, root);
 }
 
 static int og_cmd_legacy_session(const char *input, struct og_cmd *cmd)
@@ -1527,51 +2645,37 @@ static int og_cmd_legacy_session(const char *input, struct og_cmd *cmd)
 	json_object_set_new(root, "partition", partition);
 	json_object_set_new(root, "disk", disk);
 
-	og_cmd_init(cmd, OG_METHOD_POST, OG_CMD_SESSION, root);
-
-	return 0;
+	return og_cmd_init(cmd, OG_METHOD_POST, OG_CMD_SESSION, root);
 }
 
 static int og_cmd_legacy_poweroff(const char *input, struct og_cmd *cmd)
 {
-	og_cmd_init(cmd, OG_METHOD_POST, OG_CMD_POWEROFF, NULL);
-
-	return 0;
+	return og_cmd_init(cmd, OG_METHOD_POST, OG_CMD_POWEROFF, NULL);
 }
 
 static int og_cmd_legacy_refresh(const char *input, struct og_cmd *cmd)
 {
-	og_cmd_init(cmd, OG_METHOD_GET, OG_CMD_REFRESH, NULL);
-
-	return 0;
+	return og_cmd_init(cmd, OG_METHOD_GET, OG_CMD_REFRESH, NULL);
 }
 
 static int og_cmd_legacy_reboot(const char *input, struct og_cmd *cmd)
 {
-	og_cmd_init(cmd, OG_METHOD_POST, OG_CMD_REBOOT, NULL);
-
-	return 0;
+	return og_cmd_init(cmd, OG_METHOD_POST, OG_CMD_REBOOT, NULL);
 }
 
 static int og_cmd_legacy_stop(const char *input, struct og_cmd *cmd)
 {
-	og_cmd_init(cmd, OG_METHOD_POST, OG_CMD_STOP, NULL);
-
-	return 0;
+	return og_cmd_init(cmd, OG_METHOD_POST, OG_CMD_STOP, NULL);
 }
 
 static int og_cmd_legacy_hardware(const char *input, struct og_cmd *cmd)
 {
-	og_cmd_init(cmd, OG_METHOD_GET, OG_CMD_HARDWARE, NULL);
-
-	return 0;
+	return og_cmd_init(cmd, OG_METHOD_GET, OG_CMD_HARDWARE, NULL);
 }
 
 static int og_cmd_legacy_software(const char *input, struct og_cmd *cmd)
 {
-	og_cmd_init(cmd, OG_METHOD_GET, OG_CMD_SOFTWARE, NULL);
-
-	return 0;
+	return og_cmd_init(cmd, OG_METHOD_GET, OG_CMD_SOFTWARE, NULL);
 }
 
 static int og_cmd_legacy_image_create(const char *input, struct og_cmd *cmd)
@@ -1600,9 +2704,7 @@ static int og_cmd_legacy_image_create(const char *input, struct og_cmd *cmd)
 	json_object_set_new(root, "name", name);
 	json_object_set_new(root, "disk", disk);
 
-	og_cmd_init(cmd, OG_METHOD_POST, OG_CMD_IMAGE_CREATE, root);
-
-	return 0;
+	return og_cmd_init(cmd, OG_METHOD_POST, OG_CMD_IMAGE_CREATE, root);
 }
 
 #define OG_DB_RESTORE_TYPE_MAXLEN	64
@@ -1640,9 +2742,7 @@ static int og_cmd_legacy_image_restore(const char *input, struct og_cmd *cmd)
 	json_object_set_new(root, "name", name);
 	json_object_set_new(root, "disk", disk);
 
-	og_cmd_init(cmd, OG_METHOD_POST, OG_CMD_IMAGE_RESTORE, root);
-
-	return 0;
+	return og_cmd_init(cmd, OG_METHOD_POST, OG_CMD_IMAGE_RESTORE, root);
 }
 
 static int og_cmd_legacy_setup(const char *input, struct og_cmd *cmd)
@@ -1710,16 +2810,12 @@ static int og_cmd_legacy_setup(const char *input, struct og_cmd *cmd)
 	json_object_set_new(root, "cache", cache);
 	json_object_set_new(root, "disk", disk);
 
-	og_cmd_init(cmd, OG_METHOD_POST, OG_CMD_SETUP, root);
-
-	return 0;
+	return og_cmd_init(cmd, OG_METHOD_POST, OG_CMD_SETUP, root);
 }
 
 static int og_cmd_legacy_run_schedule(const char *input, struct og_cmd *cmd)
 {
-	og_cmd_init(cmd, OG_METHOD_GET, OG_CMD_RUN_SCHEDULE, NULL);
-
-	return 0;
+	return og_cmd_init(cmd, OG_METHOD_GET, OG_CMD_RUN_SCHEDULE, NULL);
 }
 
 static int og_cmd_legacy(const char *input, struct og_cmd *cmd)
@@ -1791,7 +2887,7 @@ static int og_dbi_add_action(const struct og_dbi *dbi, const struct og_task *tas
 				"VALUES (%d, %d, %d, '%s', '%s', %d, %d, '%s', "
 				"'%s', %d, %d, %d, %d, '%s', %d, %d, %d)",
 				cmd->client_id, EJECUCION_TAREA, task->task_id,
-				"", cmd->ip, 0, task->command_id,
+				"", inet_ntoa(cmd->addr), 0, task->command_id,
 				task->params, start_date_string,
 				ACCION_INICIADA, ACCION_SINRESULTADO,
 				task->type_scope, task->scope, "",
@@ -1812,44 +2908,71 @@ static int og_dbi_add_action(const struct og_dbi *dbi, const struct og_task *tas
 static int og_queue_task_command(struct og_dbi *dbi, const struct og_task *task,
 				 char *query)
 {
-	struct og_cmd *cmd;
-	const char *msglog;
+	struct og_cmd tmpl = {}, *cmd;
+	const char *msglog, *ip;
 	dbi_result result;
 
+	/* All the commands for this action share the same payload. */
+	if (og_cmd_legacy(task->params, &tmpl) < 0) {
+		syslog(LOG_ERR, "cannot queue legacy command %.32s\n",
+		       task->params);
+		og_cmd_payload_put(tmpl.payload);
+		return 0;
+	}
+
 	result = dbi_conn_queryf(dbi->conn, query);
 	if (!result) {
 		dbi_conn_error(dbi->conn, &msglog);
 		syslog(LOG_ERR, "failed to query database (%s:%d) %s\n",
 		       __func__, __LINE__, msglog);
+		og_cmd_payload_put(tmpl.payload);
 		return -1;
 	}
 
 	while (dbi_result_next_row(result)) {
-		cmd = (struct og_cmd *)calloc(1, sizeof(struct og_cmd));
+		ip = dbi_result_get_string(result, "ip");
+		if (!ip || !inet_aton(ip, &tmpl.addr)) {
+			syslog(LOG_ERR, "Invalid IP string: %s\n", ip);
+			continue;
+		}
+
+		if (tmpl.type == OG_CMD_WOL &&
+		    og_wol_target_init(&tmpl.wol, ip,
+				       dbi_result_get_string(result, "mac"),
+				       tmpl.wol.type) < 0)
+			continue;
+
+		cmd = (struct og_cmd *)malloc(sizeof(struct og_cmd));
 		if (!cmd) {
 			dbi_result_free(result);
+			og_cmd_payload_put(tmpl.payload);
 			return -1;
 		}
-
-		cmd->client_id	= dbi_result_get_uint(result, "idordenador");
-		cmd->ip		= strdup(dbi_result_get_string(result, "ip"));
-		cmd->mac	= strdup(dbi_result_get_string(result, "mac"));
-
-		og_cmd_legacy(task->params, cmd);
+		*cmd = tmpl;
+		INIT_LIST_HEAD(&cmd->list);
+		cmd->client_id = dbi_result_get_uint(result, "idordenador");
+		if (cmd->payload)
+			cmd->payload->refcnt++;
 
 		if (task->procedure_id) {
 			if (og_dbi_add_action(dbi, task, cmd)) {
+				og_cmd_free(cmd);
 				dbi_result_free(result);
+				og_cmd_payload_put(tmpl.payload);
 				return -1;
 			}
 		} else {
 			cmd->id = task->task_id;
 		}
 
-		list_add_tail(&cmd->list, &cmd_list);
+		if (task->cmd_list)
+			list_add_tail(&cmd->list, task->cmd_list);
+		else
+			og_cmd_queue(cmd);
 	}
 
 	dbi_result_free(result);
+	og_cmd_payload_put(tmpl.payload);
 
 	return 0;
 }
@@ -1857,7 +2980,6 @@ static int og_queue_task_command(struct og_dbi *dbi, const struct og_task *task,
 static int og_queue_task_group_clients(struct og_dbi *dbi, struct og_task *task,
 				       char *query)
 {
-
 	const char *msglog;
 	dbi_result result;
 
@@ -1896,7 +3018,6 @@ static int og_queue_task_group_clients(struct og_dbi *dbi, struct og_task *task,
 static int og_queue_task_group_classrooms(struct og_dbi *dbi,
 					  struct og_task *task, char *query)
 {
-
 	const char *msglog;
 	dbi_result result;
 
@@ -2015,7 +3136,7 @@ int og_dbi_queue_procedure(struct og_dbi *dbi, struct og_task *task)
 }
 
 static int og_dbi_queue_task(struct og_dbi *dbi, uint32_t task_id,
-			     uint32_t schedule_id)
+			     uint32_t schedule_id, struct list_head *cmd_list)
 {
 	struct og_task task = {};
 	uint32_t task_id_next;
@@ -2023,6 +3144,7 @@ static int og_dbi_queue_task(struct og_dbi *dbi, uint32_t task_id,
 	dbi_result result;
 
 	task.schedule_id = schedule_id;
+	task.cmd_list = cmd_list;
 
 	result = dbi_conn_queryf(dbi->conn,
 			"SELECT tareas_acciones.orden, "
@@ -2047,7 +3169,8 @@ static int og_dbi_queue_task(struct og_dbi *dbi, uint32_t task_id,
 		task_id_next = dbi_result_get_uint(result, "tareaid");
 
 		if (task_id_next > 0) {
-			if (og_dbi_queue_task(dbi, task_id_next, schedule_id))
+			if (og_dbi_queue_task(dbi, task_id_next, schedule_id,
+					      cmd_list))
 				return -1;
 
 			continue;
@@ -2068,13 +3191,15 @@ static int og_dbi_queue_task(struct og_dbi *dbi, uint32_t task_id,
 }
 
 static int og_dbi_queue_command(struct og_dbi *dbi, uint32_t task_id,
-				uint32_t schedule_id)
+				uint32_t schedule_id, struct list_head *cmd_list)
 {
 	struct og_task task = {};
 	const char *msglog;
 	dbi_result result;
 	char query[4096];
 
+	task.cmd_list = cmd_list;
+
 	result = dbi_conn_queryf(dbi->conn,
 			"SELECT idaccion, idcentro, idordenador, parametros "
 			"FROM acciones "
@@ -2153,290 +3278,404 @@ int og_dbi_update_action(uint32_t id, bool success)
 	return 0;
 }
 
-void og_schedule_run(unsigned int task_id, unsigned int schedule_id,
-		     enum og_schedule_type type)
+/* Set of IPv4 addresses, open addressing with linear probing. */
+struct og_ipset {
+	uint32_t	*slots;
+	unsigned int	size;
+	unsigned int	len;
+};
+
+static int og_ipset_grow(struct og_ipset *set)
+{
+	unsigned int i, j, size = set->size ? set->size * 2 : 256;
+	uint32_t *slots;
+
+	slots = calloc(size, sizeof(uint32_t));
+	if (!slots)
+		return -1;
+
+	for (i = 0; i < set->size; i++) {
+		if (!set->slots[i])
+			continue;
+
+		j = og_hash(&set->slots[i], sizeof(uint32_t)) & (size - 1);
+		while (slots[j])
+			j = (j + 1) & (size - 1);
+		slots[j] = set->slots[i];
+	}
+	free(set->slots);
+	set->slots = slots;
+	set->size = size;
+
+	return 0;
+}
+
+/* Returns 1 if the address has been added, 0 if it is already in the set. */
+static int og_ipset_add(struct og_ipset *set, uint32_t addr)
+{
+	unsigned int i;
+
+	if (2 * (set->len + 1) > set->size &&
+	    og_ipset_grow(set) < 0)
+		return -1;
+
+	i = og_hash(&addr, sizeof(addr)) & (set->size - 1);
+	while (set->slots[i]) {
+		if (set->slots[i] == addr)
+			return 0;
+		i = (i + 1) & (set->size - 1);
+	}
+	set->slots[i] = addr;
+	set->len++;
+
+	return 1;
+}
+
+/* Scheduled tasks run as jobs from an idle watcher: tasks are expanded from the
+ * database one at a time, then Wake On Lan packets and notifications are
+ * dispatched in slices, so agents and REST clients are still served meanwhile.
+ */
+#define OG_JOB_SLICE	64
+
+enum og_job_phase {
+	OG_JOB_EXPAND,
+	OG_JOB_WOL,
+	OG_JOB_NOTIFY,
+};
+
+struct og_job {
+	struct list_head	list;
+	enum og_job_phase	phase;
+	struct og_schedule_task	*tasks;
+	unsigned int		tasks_len;
+	unsigned int		tasks_next;
+	struct og_dbi		*dbi;
+	struct list_head	cmd_list;
+	struct og_ipset		ipset;
+	char			**ips;
+	unsigned int		ips_len;
+	unsigned int		ips_size;
+	unsigned int		ips_next;
+};
+
+static LIST_HEAD(job_list);
+static struct ev_idle og_job_idle;
+
+static void og_job_free(struct og_job *job)
 {
-	struct og_msg_params params = {};
-	bool duplicated = false;
 	struct og_cmd *cmd, *next;
-	struct og_dbi *dbi;
 	unsigned int i;
 
-	dbi = og_dbi_open(&dbi_config);
-	if (!dbi) {
-		syslog(LOG_ERR, "cannot open connection database (%s:%d)\n",
-		       __func__, __LINE__);
-		return;
+	list_for_each_entry_safe(cmd, next, &job->cmd_list, list) {
+		list_del(&cmd->list);
+		og_cmd_free(cmd);
+	}
+	for (i = 0; i < job->ips_len; i++)
+		free(job->ips[i]);
+	free(job->ips);
+	free(job->ipset.slots);
+	free(job->tasks);
+	if (job->dbi)
+		og_dbi_close(job->dbi);
+	free(job);
+}
+
+/* Expands the next task in this job, the database connection is kept open
+ * until the last one has been expanded.
+ */
+static int og_job_expand(struct og_job *job)
+{
+	struct og_schedule_task *task;
+
+	if (!job->dbi) {
+		job->dbi = og_dbi_open(&dbi_config);
+		if (!job->dbi) {
+			syslog(LOG_ERR, "cannot open connection database (%s:%d)\n",
+			       __func__, __LINE__);
+			return -1;
+		}
 	}
 
-	switch (type) {
+	task = &job->tasks[job->tasks_next++];
+	switch (task->type) {
 	case OG_SCHEDULE_TASK:
-		og_dbi_queue_task(dbi, task_id, schedule_id);
+		og_dbi_queue_task(job->dbi, task->task_id,
+				  task->schedule_id, &job->cmd_list);
 		break;
 	case OG_SCHEDULE_PROCEDURE:
 	case OG_SCHEDULE_COMMAND:
-		og_dbi_queue_command(dbi, task_id, schedule_id);
+		og_dbi_queue_command(job->dbi, task->task_id,
+				     task->schedule_id, &job->cmd_list);
 		break;
 	}
-	og_dbi_close(dbi);
-
-	list_for_each_entry(cmd, &cmd_list, list) {
-		for (i = 0; i < params.ips_array_len; i++) {
-			if (!strncmp(cmd->ip, params.ips_array[i],
-				     OG_DB_IP_MAXLEN)) {
-				duplicated = true;
-				break;
-			}
-		}
 
-		if (!duplicated)
-			params.ips_array[params.ips_array_len++] = cmd->ip;
-		else
-			duplicated = false;
+	if (job->tasks_next == job->tasks_len) {
+		og_dbi_close(job->dbi);
+		job->dbi = NULL;
+		job->phase = OG_JOB_WOL;
 	}
 
-	list_for_each_entry_safe(cmd, next, &cmd_list, list) {
-		if (cmd->type != OG_CMD_WOL)
-			continue;
+	return 0;
+}
 
-		if (Levanta((char **)cmd->params.ips_array,
-			    (char **)cmd->params.mac_array,
-			    cmd->params.ips_array_len,
-			    (char *)cmd->params.wol_type))
-			og_dbi_update_action(cmd->id, true);
+static int og_job_add_ip(struct og_job *job, struct in_addr addr)
+{
+	char **ips;
+	int ret;
 
-		list_del(&cmd->list);
-		og_cmd_free(cmd);
+	ret = og_ipset_add(&job->ipset, addr.s_addr);
+	if (ret <= 0)
+		return ret;
+
+	if (job->ips_len == job->ips_size) {
+		ips = realloc(job->ips, (job->ips_size + OG_JOB_SLICE) *
+					sizeof(char *));
+		if (!ips)
+			return -1;
+
+		job->ips = ips;
+		job->ips_size += OG_JOB_SLICE;
 	}
+	job->ips[job->ips_len] = strdup(inet_ntoa(addr));
+	if (!job->ips[job->ips_len])
+		return -1;
+	job->ips_len++;
 
-	og_send_request(OG_METHOD_GET, OG_CMD_RUN_SCHEDULE, &params, NULL);
+	return 1;
 }
 
-static int og_cmd_task_post(json_t *element, struct og_msg_params *params)
+/* Queues the next slice of commands for their agents, or for the wake engine
+ * if they are Wake On Lan, and records the target IPs.
+ */
+static void og_job_wol(struct og_job *job)
 {
-	struct og_cmd *cmd;
-	struct og_dbi *dbi;
-	const char *key;
-	json_t *value;
-	int err;
+	struct og_cmd *cmd, *next;
+	unsigned int i = 0;
 
-	if (json_typeof(element) != JSON_OBJECT)
-		return -1;
+	list_for_each_entry_safe(cmd, next, &job->cmd_list, list) {
+		if (i++ == OG_JOB_SLICE)
+			return;
 
-	json_object_foreach(element, key, value) {
-		if (!strcmp(key, "task")) {
-			err = og_json_parse_string(value, &params->task_id);
-			params->flags |= OG_REST_PARAM_TASK;
+		if (og_job_add_ip(job, cmd->addr) < 0)
+			syslog(LOG_ERR, "OOM while running task %u\n",
+			       job->tasks[0].task_id);
+
+		list_del(&cmd->list);
+		if (cmd->type != OG_CMD_WOL) {
+			og_cmd_queue(cmd);
+			continue;
 		}
 
-		if (err < 0)
-			break;
+		if (og_client_find_addr(cmd->addr))
+			og_dbi_update_action(cmd->id, true);
+		else
+			og_wol_wake(&cmd->wol, cmd->id);
+
+		og_cmd_free(cmd);
 	}
 
-	if (!og_msg_params_validate(params, OG_REST_PARAM_TASK))
-		return -1;
+	job->phase = OG_JOB_NOTIFY;
+}
 
-	dbi = og_dbi_open(&dbi_config);
-	if (!dbi) {
-		syslog(LOG_ERR, "cannot open connection database (%s:%d)\n",
-			   __func__, __LINE__);
-		return -1;
-	}
+/* Tells the next slice of clients to fetch their pending commands. */
+static void og_job_notify(struct og_job *job)
+{
+	struct og_msg_params params = {};
 
-	og_schedule_run(atoi(params->task_id), 0, OG_SCHEDULE_TASK);
-	og_dbi_close(dbi);
+	params.ips_array = (const char **)&job->ips[job->ips_next];
+	params.ips_array_len = job->ips_len - job->ips_next;
+	if (params.ips_array_len > OG_JOB_SLICE)
+		params.ips_array_len = OG_JOB_SLICE;
 
-	list_for_each_entry(cmd, &cmd_list, list)
-		params->ips_array[params->ips_array_len++] = cmd->ip;
+	job->ips_next += params.ips_array_len;
 
-	return og_send_request(OG_METHOD_GET, OG_CMD_RUN_SCHEDULE, params,
-			       NULL);
+	og_send_request(OG_METHOD_GET, OG_CMD_RUN_SCHEDULE, &params, NULL);
 }
 
-static int og_dbi_scope_get_center(struct og_dbi *dbi, json_t *array)
+static void og_job_idle_cb(struct ev_loop *loop, struct ev_idle *idle,
+			   int events)
 {
-	char center_name[OG_DB_CENTER_NAME_MAXLEN + 1] = {};
-	const char *msglog;
-	uint32_t center_id;
-	dbi_result result;
-	json_t *center;
+	struct og_job *job;
 
-	result = dbi_conn_queryf(dbi->conn,
-				 "SELECT nombrecentro, idcentro FROM centros");
-	if (!result) {
-		dbi_conn_error(dbi->conn, &msglog);
-		syslog(LOG_ERR, "failed to query database (%s:%d) %s\n",
-		       __func__, __LINE__, msglog);
-		return -1;
+	if (list_empty(&job_list)) {
+		ev_idle_stop(loop, idle);
+		return;
 	}
+	job = list_first_entry(&job_list, struct og_job, list);
 
-	while (dbi_result_next_row(result)) {
-		center_id = dbi_result_get_uint(result, "idcentro");
-		strncpy(center_name,
-			dbi_result_get_string(result, "nombrecentro"),
-			OG_DB_CENTER_NAME_MAXLEN);
-
-		center = json_object();
-		if (!center) {
-			dbi_result_free(result);
-			return -1;
-		}
-
-		json_object_set_new(center, "name", json_string(center_name));
-		json_object_set_new(center, "type", json_string("center"));
-		json_object_set_new(center, "id", json_integer(center_id));
-		json_object_set_new(center, "scope", json_array());
-		json_array_append(array, center);
-		json_decref(center);
+	switch (job->phase) {
+	case OG_JOB_EXPAND:
+		if (og_job_expand(job) < 0)
+			break;
+		return;
+	case OG_JOB_WOL:
+		og_job_wol(job);
+		return;
+	case OG_JOB_NOTIFY:
+		og_job_notify(job);
+		if (job->ips_next < job->ips_len)
+			return;
+		break;
 	}
-	dbi_result_free(result);
 
-	return 0;
+	list_del(&job->list);
+	og_job_free(job);
 }
 
-static int og_dbi_scope_get_room(struct og_dbi *dbi, json_t *array,
-				 uint32_t center_id)
+void og_schedule_run(const struct og_schedule_task *tasks, unsigned int len)
 {
-	char room_name[OG_DB_ROOM_NAME_MAXLEN + 1] = {};
-	const char *msglog;
-	dbi_result result;
-	uint32_t room_id;
-	json_t *room;
+	struct og_job *job;
 
-	result = dbi_conn_queryf(dbi->conn,
-				 "SELECT idaula, nombreaula FROM aulas WHERE "
-				 "idcentro=%d",
-				 center_id);
-	if (!result) {
-		dbi_conn_error(dbi->conn, &msglog);
-		syslog(LOG_ERR, "failed to query database (%s:%d) %s\n",
-		       __func__, __LINE__, msglog);
-		return -1;
+	job = calloc(1, sizeof(struct og_job));
+	if (!job) {
+		syslog(LOG_ERR, "OOM while running task %u\n", tasks[0].task_id);
+		return;
 	}
 
-	while (dbi_result_next_row(result)) {
-		room_id = dbi_result_get_uint(result, "idaula");
-		strncpy(room_name,
-			dbi_result_get_string(result, "nombreaula"),
-			OG_DB_CENTER_NAME_MAXLEN);
+	job->tasks = malloc(len * sizeof(struct og_schedule_task));
+	if (!job->tasks) {
+		syslog(LOG_ERR, "OOM while running task %u\n", tasks[0].task_id);
+		free(job);
+		return;
+	}
+	memcpy(job->tasks, tasks, len * sizeof(struct og_schedule_task));
+	job->tasks_len = len;
 
-		room = json_object();
-		if (!room) {
-			dbi_result_free(result);
-			return -1;
-		}
+	INIT_LIST_HEAD(&job->cmd_list);
+	list_add_tail(&job->list, &job_list);
 
-		json_object_set_new(room, "name", json_string(room_name));
-		json_object_set_new(room, "type", json_string("room"));
-		json_object_set_new(room, "id", json_integer(room_id));
-		json_object_set_new(room, "scope", json_array());
-		json_array_append(array, room);
-		json_decref(room);
+	if (!ev_is_active(&og_job_idle)) {
+		ev_idle_init(&og_job_idle, og_job_idle_cb);
+		ev_idle_start(og_loop, &og_job_idle);
 	}
-	dbi_result_free(result);
+}
+
+static int og_cmd_task_post(json_t *element, struct og_msg_params *params)
+{
+	struct og_schedule_task task = {
+		.type	= OG_SCHEDULE_TASK,
+	};
+
+	if (og_msg_params_parse(element, params, OG_REST_PARAM_TASK) < 0)
+		return -1;
+
+	task.task_id = atoi(params->task_id);
+	og_schedule_run(&task, 1);
 
 	return 0;
 }
 
-static int og_dbi_scope_get_computer(struct og_dbi *dbi, json_t *array,
-				     uint32_t room_id)
+static int og_stream_scope_node(struct og_stream *stream, const char *name,
+				const char *type, uint32_t id, bool leaf)
 {
-	char computer_name[OG_DB_COMPUTER_NAME_MAXLEN + 1] = {};
-	uint32_t computer_id;
-	const char *msglog;
-	dbi_result result;
-	json_t *computer;
+	json_t *str;
+	int err;
 
-	result = dbi_conn_queryf(dbi->conn,
-				 "SELECT idordenador, nombreordenador, ip "
-				 "FROM ordenadores WHERE idaula=%d",
-				 room_id);
-	if (!result) {
-		dbi_conn_error(dbi->conn, &msglog);
-		syslog(LOG_ERR, "failed to query database (%s:%d) %s\n",
-		       __func__, __LINE__, msglog);
+	if (og_buffer_printf(&stream->chunk, "%s{",
+			     stream->first ? "" : ", ") < 0)
 		return -1;
-	}
 
-	while (dbi_result_next_row(result)) {
-		computer_id = dbi_result_get_uint(result, "idordenador");
-		strncpy(computer_name,
-			dbi_result_get_string(result, "nombreordenador"),
-			OG_DB_CENTER_NAME_MAXLEN);
-
-		computer = json_object();
-		if (!computer) {
-			dbi_result_free(result);
+	str = json_string(name);
+	if (str) {
+		err = og_buffer_printf(&stream->chunk, "\"name\": ");
+		if (!err)
+			err = json_dump_callback(str, og_json_dump_clients,
+						 &stream->chunk,
+						 JSON_ENCODE_ANY);
+		json_decref(str);
+		if (err || og_buffer_printf(&stream->chunk, ", ") < 0)
 			return -1;
-		}
-
-		json_object_set_new(computer, "name", json_string(computer_name));
-		json_object_set_new(computer, "type", json_string("computer"));
-		json_object_set_new(computer, "id", json_integer(computer_id));
-		json_object_set_new(computer, "scope", json_array());
-		json_array_append(array, computer);
-		json_decref(computer);
 	}
-	dbi_result_free(result);
+
+	if (og_buffer_printf(&stream->chunk,
+			     "\"type\": \"%s\", \"id\": %u, \"scope\": [%s",
+			     type, id, leaf ? "]}" : "") < 0)
+		return -1;
+
+	stream->first = !leaf;
 
 	return 0;
 }
 
-static int og_cmd_scope_get(json_t *element, struct og_msg_params *params,
-			    char *buffer_reply)
+static int og_stream_scope_close(struct og_stream *stream)
 {
-	json_t *root, *children_root, *children_center, *children_room,
-	       *center_value, *room_value;
-	uint32_t center_id, room_id, index1, index2;
-	struct og_dbi *dbi;
+	stream->first = false;
 
-	struct og_buffer og_buffer = {
-		.data = buffer_reply
-	};
+	return og_buffer_printf(&stream->chunk, "]}");
+}
 
-	root = json_object();
-	children_root = json_array();
-	if (!root || !children_root)
-		return -1;
+/* Walks the scope tree one node at a time, level 0 iterates over centers,
+ * level 1 over the rooms of the current center and level 2 over the computers
+ * of the current room.
+ */
+static int og_stream_scope_next(struct og_stream *stream)
+{
+	struct og_scope_computer *computer;
+	struct og_scope_center *center;
+	struct og_scope_room *room;
+
+	switch (stream->scope.level) {
+	case 0:
+		stream->scope.center = stream->scope.center->next;
+		if (stream->scope.center == &og_scope_tree.center_list)
+			return og_stream_scope_close(stream) < 0 ? -1 : 1;
+
+		center = list_entry(stream->scope.center,
+				    struct og_scope_center, list);
+		stream->scope.room = &center->room_list;
+		stream->scope.level++;
+
+		return og_stream_scope_node(stream, center->name, "center",
+					    center->id, false);
+	case 1:
+		center = list_entry(stream->scope.center,
+				    struct og_scope_center, list);
+		stream->scope.room = stream->scope.room->next;
+		if (stream->scope.room == &center->room_list) {
+			stream->scope.level--;
+			return og_stream_scope_close(stream);
+		}
 
-	json_object_set(root, "scope", children_root);
+		room = list_entry(stream->scope.room, struct og_scope_room, list);
+		stream->scope.computer = &room->computer_list;
+		stream->scope.level++;
+
+		return og_stream_scope_node(stream, room->name, "room",
+					    room->id, false);
+	case 2:
+		room = list_entry(stream->scope.room, struct og_scope_room, list);
+		stream->scope.computer = stream->scope.computer->next;
+		if (stream->scope.computer == &room->computer_list) {
+			stream->scope.level--;
+			return og_stream_scope_close(stream);
+		}
 
-	dbi = og_dbi_open(&dbi_config);
-	if (!dbi) {
-		syslog(LOG_ERR, "cannot open connection database (%s:%d)\n",
-		       __func__, __LINE__);
-		return -1;
-	}
+		computer = list_entry(stream->scope.computer,
+				      struct og_scope_computer, list);
 
-	if (og_dbi_scope_get_center(dbi, children_root)) {
-		og_dbi_close(dbi);
-		return -1;
+		return og_stream_scope_node(stream, computer->name, "computer",
+					    computer->id, true);
 	}
 
-	json_array_foreach(children_root, index1, center_value) {
-		center_id = json_integer_value(json_object_get(center_value,"id"));
-		children_center = json_object_get(center_value, "scope");
-		if (og_dbi_scope_get_room(dbi, children_center, center_id)) {
-			og_dbi_close(dbi);
-			return -1;
-		}
+	return -1;
+}
+
+static int og_cmd_scope_get(json_t *element, struct og_msg_params *params,
+			    struct og_client *cli)
+{
+	struct og_stream *stream;
 
-		json_array_foreach(children_center, index2, room_value) {
-			room_id = json_integer_value(json_object_get(room_value, "id"));
-			children_room = json_object_get(room_value, "scope");
-			if (og_dbi_scope_get_computer(dbi, children_room, room_id)) {
-				og_dbi_close(dbi);
-				return -1;
-			}
-		}
-	}
+	if (og_scope_refresh() < 0)
+		return -1;
 
-	og_dbi_close(dbi);
+	stream = og_stream_new(cli, OG_STREAM_SCOPE, og_stream_scope_next);
+	if (!stream)
+		return -1;
 
-	json_dump_callback(root, og_json_dump_clients, &og_buffer, 0);
-	json_decref(root);
+	og_scope_tree.users++;
+	stream->scope.center = &og_scope_tree.center_list;
 
-	return 0;
+	return og_buffer_printf(&stream->chunk, "{\"scope\": [");
 }
 
 int og_dbi_schedule_get(void)
@@ -2479,7 +3718,6 @@ int og_dbi_schedule_get(void)
 		time.hours = dbi_result_get_uint(result, "horas");
 		time.am_pm = dbi_result_get_uint(result, "ampm");
 		time.minutes = dbi_result_get_uint(result, "minutos");
-		time.on_start = true;
 
 		og_schedule_create(schedule_id, task_id, OG_SCHEDULE_TASK,
 				   &time);
@@ -2600,14 +3838,12 @@ struct og_db_schedule {
 	uint32_t		session;
 };
 
-static int og_dbi_schedule_get_json(struct og_dbi *dbi, json_t *root,
-				    const char *task_id, const char *schedule_id)
+static dbi_result og_dbi_schedule_query(struct og_dbi *dbi,
+					const char *task_id,
+					const char *schedule_id)
 {
-	struct og_db_schedule schedule;
-	json_t *obj, *array;
 	const char *msglog;
 	dbi_result result;
-	int err = 0;
 
 	if (task_id) {
 		result = dbi_conn_queryf(dbi->conn,
@@ -2643,55 +3879,50 @@ static int og_dbi_schedule_get_json(struct og_dbi *dbi, json_t *root,
 		dbi_conn_error(dbi->conn, &msglog);
 		syslog(LOG_ERR, "failed to query database (%s:%d) %s\n",
 		       __func__, __LINE__, msglog);
-		return -1;
-	}
-
-	array = json_array();
-	if (!array)
-		return -1;
-
-	while (dbi_result_next_row(result)) {
-		schedule.id = dbi_result_get_uint(result, "idprogramacion");
-		schedule.task_id = dbi_result_get_uint(result, "identificador");
-		schedule.name = dbi_result_get_string(result, "nombrebloque");
-		schedule.time.years = dbi_result_get_uint(result, "annos");
-		schedule.time.months = dbi_result_get_uint(result, "meses");
-		schedule.time.days = dbi_result_get_uint(result, "diario");
-		schedule.time.hours = dbi_result_get_uint(result, "horas");
-		schedule.time.am_pm = dbi_result_get_uint(result, "ampm");
-		schedule.time.minutes = dbi_result_get_uint(result, "minutos");
-		schedule.week_days = dbi_result_get_uint(result, "dias");
-		schedule.weeks = dbi_result_get_uint(result, "semanas");
-		schedule.suspended = dbi_result_get_uint(result, "suspendida");
-		schedule.session = dbi_result_get_uint(result, "sesion");
-
-		obj = json_object();
-		if (!obj) {
-			err = -1;
-			break;
-		}
-		json_object_set_new(obj, "id", json_integer(schedule.id));
-		json_object_set_new(obj, "task", json_integer(schedule.task_id));
-		json_object_set_new(obj, "name", json_string(schedule.name));
-		json_object_set_new(obj, "years", json_integer(schedule.time.years));
-		json_object_set_new(obj, "months", json_integer(schedule.time.months));
-		json_object_set_new(obj, "days", json_integer(schedule.time.days));
-		json_object_set_new(obj, "hours", json_integer(schedule.time.hours));
-		json_object_set_new(obj, "am_pm", json_integer(schedule.time.am_pm));
-		json_object_set_new(obj, "minutes", json_integer(schedule.time.minutes));
-		json_object_set_new(obj, "week_days", json_integer(schedule.week_days));
-		json_object_set_new(obj, "weeks", json_integer(schedule.weeks));
-		json_object_set_new(obj, "suspended", json_integer(schedule.suspended));
-		json_object_set_new(obj, "session", json_integer(schedule.session));
-
-		json_array_append_new(array, obj);
+		return NULL;
 	}
 
-	json_object_set_new(root, "schedule", array);
+	return result;
+}
 
-	dbi_result_free(result);
+static json_t *og_dbi_schedule_json(dbi_result result)
+{
+	struct og_db_schedule schedule;
+	json_t *obj;
+
+	schedule.id = dbi_result_get_uint(result, "idprogramacion");
+	schedule.task_id = dbi_result_get_uint(result, "identificador");
+	schedule.name = dbi_result_get_string(result, "nombrebloque");
+	schedule.time.years = dbi_result_get_uint(result, "annos");
+	schedule.time.months = dbi_result_get_uint(result, "meses");
+	schedule.time.days = dbi_result_get_uint(result, "diario");
+	schedule.time.hours = dbi_result_get_uint(result, "horas");
+	schedule.time.am_pm = dbi_result_get_uint(result, "ampm");
+	schedule.time.minutes = dbi_result_get_uint(result, "minutos");
+	schedule.week_days = dbi_result_get_uint(result, "dias");
+	schedule.weeks = dbi_result_get_uint(result, "semanas");
+	schedule.suspended = dbi_result_get_uint(result, "suspendida");
+	schedule.session = dbi_result_get_uint(result, "sesion");
+
+	obj = json_object();
+	if (!obj)
+		return NULL;
 
-	return err;
+	json_object_set_new(obj, "id", json_integer(schedule.id));
+	json_object_set_new(obj, "task", json_integer(schedule.task_id));
+	json_object_set_new(obj, "name", json_string(schedule.name));
+	json_object_set_new(obj, "years", json_integer(schedule.time.years));
+	json_object_set_new(obj, "months", json_integer(schedule.time.months));
+	json_object_set_new(obj, "days", json_integer(schedule.time.days));
+	json_object_set_new(obj, "hours", json_integer(schedule.time.hours));
+	json_object_set_new(obj, "am_pm", json_integer(schedule.time.am_pm));
+	json_object_set_new(obj, "minutes", json_integer(schedule.time.minutes));
+	json_object_set_new(obj, "week_days", json_integer(schedule.week_days));
+	json_object_set_new(obj, "weeks", json_integer(schedule.weeks));
+	json_object_set_new(obj, "suspended", json_integer(schedule.suspended));
+	json_object_set_new(obj, "session", json_integer(schedule.session));
+
+	return obj;
 }
 
 static int og_task_schedule_create(struct og_msg_params *params)
@@ -2732,42 +3963,17 @@ static int og_task_schedule_create(struct og_msg_params *params)
 
 static int og_cmd_schedule_create(json_t *element, struct og_msg_params *params)
 {
-	const char *key;
-	json_t *value;
-	int err;
-
-	if (json_typeof(element) != JSON_OBJECT)
-		return -1;
-
-	json_object_foreach(element, key, value) {
-		if (!strcmp(key, "task")) {
-			err = og_json_parse_string(value, &params->task_id);
-			params->flags |= OG_REST_PARAM_TASK;
-		} else if (!strcmp(key, "name")) {
-			err = og_json_parse_string(value, &params->name);
-			params->flags |= OG_REST_PARAM_NAME;
-		} else if (!strcmp(key, "when")) {
-			err = og_json_parse_time_params(value, params);
-		} else if (!strcmp(key, "type")) {
-			err = og_json_parse_string(value, &params->type);
-			params->flags |= OG_REST_PARAM_TYPE;
-		}
-
-		if (err < 0)
-			break;
-	}
-
-	if (!og_msg_params_validate(params, OG_REST_PARAM_TASK |
-					    OG_REST_PARAM_NAME |
-					    OG_REST_PARAM_TIME_YEARS |
-					    OG_REST_PARAM_TIME_MONTHS |
-					    OG_REST_PARAM_TIME_WEEKS |
-					    OG_REST_PARAM_TIME_WEEK_DAYS |
-					    OG_REST_PARAM_TIME_DAYS |
-					    OG_REST_PARAM_TIME_HOURS |
-					    OG_REST_PARAM_TIME_MINUTES |
-					    OG_REST_PARAM_TIME_AM_PM |
-					    OG_REST_PARAM_TYPE))
+	if (og_msg_params_parse(element, params, OG_REST_PARAM_TASK |
+						OG_REST_PARAM_NAME |
+						OG_REST_PARAM_TIME_YEARS |
+						OG_REST_PARAM_TIME_MONTHS |
+						OG_REST_PARAM_TIME_WEEKS |
+						OG_REST_PARAM_TIME_WEEK_DAYS |
+						OG_REST_PARAM_TIME_DAYS |
+						OG_REST_PARAM_TIME_HOURS |
+						OG_REST_PARAM_TIME_MINUTES |
+						OG_REST_PARAM_TIME_AM_PM |
+						OG_REST_PARAM_TYPE) < 0)
 		return -1;
 
 	return og_task_schedule_create(params);
@@ -2776,39 +3982,17 @@ static int og_cmd_schedule_create(json_t *element, struct og_msg_params *params)
 static int og_cmd_schedule_update(json_t *element, struct og_msg_params *params)
 {
 	struct og_dbi *dbi;
-	const char *key;
-	json_t *value;
 	int err;
 
-	if (json_typeof(element) != JSON_OBJECT)
-		return -1;
-
-	json_object_foreach(element, key, value) {
-		if (!strcmp(key, "id")) {
-			err = og_json_parse_string(value, &params->id);
-			params->flags |= OG_REST_PARAM_ID;
-		} else if (!strcmp(key, "task")) {
-			err = og_json_parse_string(value, &params->task_id);
-			params->flags |= OG_REST_PARAM_TASK;
-		} else if (!strcmp(key, "name")) {
-			err = og_json_parse_string(value, &params->name);
-			params->flags |= OG_REST_PARAM_NAME;
-		} else if (!strcmp(key, "when"))
-			err = og_json_parse_time_params(value, params);
-
-		if (err < 0)
-			break;
-	}
-
-	if (!og_msg_params_validate(params, OG_REST_PARAM_ID |
-					    OG_REST_PARAM_TASK |
-					    OG_REST_PARAM_NAME |
-					    OG_REST_PARAM_TIME_YEARS |
-					    OG_REST_PARAM_TIME_MONTHS |
-					    OG_REST_PARAM_TIME_DAYS |
-					    OG_REST_PARAM_TIME_HOURS |
-					    OG_REST_PARAM_TIME_MINUTES |
-					    OG_REST_PARAM_TIME_AM_PM))
+	if (og_msg_params_parse(element, params, OG_REST_PARAM_ID |
+						OG_REST_PARAM_TASK |
+						OG_REST_PARAM_NAME |
+						OG_REST_PARAM_TIME_YEARS |
+						OG_REST_PARAM_TIME_MONTHS |
+						OG_REST_PARAM_TIME_DAYS |
+						OG_REST_PARAM_TIME_HOURS |
+						OG_REST_PARAM_TIME_MINUTES |
+						OG_REST_PARAM_TIME_AM_PM) < 0)
 		return -1;
 
 	dbi = og_dbi_open(&dbi_config);
@@ -2834,26 +4018,10 @@ static int og_cmd_schedule_update(json_t *element, struct og_msg_params *params)
 static int og_cmd_schedule_delete(json_t *element, struct og_msg_params *params)
 {
 	struct og_dbi *dbi;
-	const char *key;
-	json_t *value;
 	int err;
 
-	if (json_typeof(element) != JSON_OBJECT)
-		return -1;
-
-	json_object_foreach(element, key, value) {
-		if (!strcmp(key, "id")) {
-			err = og_json_parse_string(value, &params->id);
-			params->flags |= OG_REST_PARAM_ID;
-		} else {
-			return -1;
-		}
-
-		if (err < 0)
-			break;
-	}
-
-	if (!og_msg_params_validate(params, OG_REST_PARAM_ID))
+	if (og_msg_params_parse(element, params, OG_REST_PARAM_ID) < 0 ||
+	    json_object_size(element) != 1)
 		return -1;
 
 	dbi = og_dbi_open(&dbi_config);
@@ -2871,35 +4039,43 @@ static int og_cmd_schedule_delete(json_t *element, struct og_msg_params *params)
 	return err;
 }
 
+static int og_stream_schedule_next(struct og_stream *stream)
+{
+	json_t *obj;
+	int err;
+
+	if (!dbi_result_next_row(stream->schedule.result))
+		return og_buffer_printf(&stream->chunk, "]}") < 0 ? -1 : 1;
+
+	obj = og_dbi_schedule_json(stream->schedule.result);
+	if (!obj)
+		return -1;
+
+	err = og_buffer_printf(&stream->chunk, "%s", stream->first ? "" : ", ");
+	if (!err)
+		err = json_dump_callback(obj, og_json_dump_clients,
+					 &stream->chunk, 0);
+	json_decref(obj);
+
+	stream->first = false;
+
+	return err ? -1 : 0;
+}
+
 static int og_cmd_schedule_get(json_t *element, struct og_msg_params *params,
-			       char *buffer_reply)
+			       struct og_client *cli)
 {
-	struct og_buffer og_buffer = {
-		.data	= buffer_reply,
-	};
-	json_t *schedule_root;
+	struct og_stream *stream;
+	dbi_result result;
 	struct og_dbi *dbi;
-	const char *key;
-	json_t *value;
 	int err;
 
 	if (element) {
-		if (json_typeof(element) != JSON_OBJECT)
+		err = og_json_parse_params(element, &og_rest_params, params,
+					   &params->flags,
+					   OG_REST_PARAM_TASK | OG_REST_PARAM_ID);
+		if (err < 0 || err != json_object_size(element))
 			return -1;
-
-		json_object_foreach(element, key, value) {
-			if (!strcmp(key, "task")) {
-				err = og_json_parse_string(value,
-							   &params->task_id);
-			} else if (!strcmp(key, "id")) {
-				err = og_json_parse_string(value, &params->id);
-			} else {
-				return -1;
-			}
-
-			if (err < 0)
-				break;
-		}
 	}
 
 	dbi = og_dbi_open(&dbi_config);
@@ -2909,22 +4085,22 @@ static int og_cmd_schedule_get(json_t *element, struct og_msg_params *params,
 		return -1;
 	}
 
-	schedule_root = json_object();
-	if (!schedule_root) {
+	result = og_dbi_schedule_query(dbi, params->task_id, params->id);
+	if (!result) {
 		og_dbi_close(dbi);
 		return -1;
 	}
 
-	err = og_dbi_schedule_get_json(dbi, schedule_root,
-				       params->task_id, params->id);
-	og_dbi_close(dbi);
-
-	if (err >= 0)
-		json_dump_callback(schedule_root, og_json_dump_clients, &og_buffer, 0);
-
-	json_decref(schedule_root);
+	stream = og_stream_new(cli, OG_STREAM_SCHEDULE, og_stream_schedule_next);
+	if (!stream) {
+		dbi_result_free(result);
+		og_dbi_close(dbi);
+		return -1;
+	}
+	stream->schedule.dbi = dbi;
+	stream->schedule.result = result;
 
-	return err;
+	return og_buffer_printf(&stream->chunk, "{\"schedule\": [");
 }
 
 static int og_client_method_not_found(struct og_client *cli)
@@ -2979,317 +4155,394 @@ static int og_server_internal_error(struct og_client *cli)
 	return -1;
 }
 
-#define OG_MSG_RESPONSE_MAXLEN	65536
-
-static int og_client_ok(struct og_client *cli, char *buf_reply)
+static int og_client_not_modified(struct og_client *cli, const char *etag)
 {
-	char buf[OG_MSG_RESPONSE_MAXLEN] = {};
-	int err = 0, len;
+	char buf[128];
 
-	len = snprintf(buf, sizeof(buf),
-		       "HTTP/1.1 200 OK\r\nContent-Length: %ld\r\n\r\n%s",
-		       strlen(buf_reply), buf_reply);
-	if (len >= (int)sizeof(buf))
-		err = og_server_internal_error(cli);
+	snprintf(buf, sizeof(buf),
+		 "HTTP/1.1 304 Not Modified\r\nETag: %s\r\n\r\n", etag);
 
 	send(og_client_socket(cli), buf, strlen(buf), 0);
 
-	return err;
+	return 0;
 }
 
-int og_client_state_process_payload_rest(struct og_client *cli)
+static int og_client_send_reply(struct og_client *cli,
+				const struct og_buffer *og_buffer,
+				const char *etag, enum og_encoding encoding)
 {
-	char buf_reply[OG_MSG_RESPONSE_MAXLEN] = {};
-	struct og_msg_params params = {};
-	enum og_rest_method method;
-	const char *cmd, *body;
-	json_error_t json_err;
-	json_t *root = NULL;
-	int err = 0;
+	char etag_hdr[OG_ETAG_MAXLEN + 8] = {};
+	char encoding_hdr[64] = {};
+	struct iovec iov[2];
+	char buf[256];
+
+	if (etag[0])
+		snprintf(etag_hdr, sizeof(etag_hdr), "ETag: %s\r\n", etag);
+	if (encoding != OG_ENCODING_IDENTITY)
+		snprintf(encoding_hdr, sizeof(encoding_hdr),
+			 "Content-Encoding: %s\r\n", og_encoding_str[encoding]);
+
+	iov[0].iov_base = buf;
+	iov[0].iov_len = snprintf(buf, sizeof(buf),
+				  "HTTP/1.1 200 OK\r\n%s%s"
+				  "Vary: Accept-Encoding\r\n"
+				  "Content-Length: %zu\r\n\r\n",
+				  etag_hdr, encoding_hdr, og_buffer->len);
+	iov[1].iov_base = og_buffer->data;
+	iov[1].iov_len = og_buffer->len;
+
+	writev(og_client_socket(cli), iov, 2);
 
-	syslog(LOG_DEBUG, "%s:%hu %.32s ...\n",
-	       inet_ntoa(cli->addr.sin_addr),
-	       ntohs(cli->addr.sin_port), cli->buf);
+	return 0;
+}
 
-	if (!strncmp(cli->buf, "GET", strlen("GET"))) {
-		method = OG_METHOD_GET;
-		cmd = cli->buf + strlen("GET") + 2;
-	} else if (!strncmp(cli->buf, "POST", strlen("POST"))) {
-		method = OG_METHOD_POST;
-		cmd = cli->buf + strlen("POST") + 2;
-	} else
-		return og_client_method_not_found(cli);
+static int og_client_ok(struct og_client *cli,
+			const struct og_buffer *og_buffer, const char *etag)
+{
+	struct og_buffer zbuf = {};
+	z_stream zs;
+	int err;
 
-	body = strstr(cli->buf, "\r\n\r\n") + 4;
+	if (cli->encoding == OG_ENCODING_IDENTITY ||
+	    og_buffer->len < OG_DEFLATE_MINLEN)
+		return og_client_send_reply(cli, og_buffer, etag,
+					    OG_ENCODING_IDENTITY);
 
-	if (strcmp(cli->auth_token, auth_token)) {
-		syslog(LOG_ERR, "wrong Authentication key\n");
-		return og_client_not_authorized(cli);
+	if (og_deflate_init(&zs, cli->encoding) < 0)
+		return og_server_internal_error(cli);
+
+	err = og_deflate(&zs, og_buffer->data, og_buffer->len, &zbuf, true);
+	deflateEnd(&zs);
+	if (err < 0) {
+		free(zbuf.data);
+		return og_server_internal_error(cli);
 	}
 
-	if (cli->content_length) {
-		root = json_loads(body, 0, &json_err);
-		if (!root) {
-			syslog(LOG_ERR, "malformed json line %d: %s\n",
-			       json_err.line, json_err.text);
-			return og_client_not_found(cli);
+	err = og_client_send_reply(cli, &zbuf, etag, cli->encoding);
+	free(zbuf.data);
+
+	return err;
+}
+
+static int og_client_stream_start(struct og_client *cli, const char *etag)
+{
+	struct og_stream *stream = cli->stream;
+	char etag_hdr[OG_ETAG_MAXLEN + 8] = {};
+	char encoding_hdr[64] = {};
+	const char *type_hdr = "";
+
+	if (etag[0])
+		snprintf(etag_hdr, sizeof(etag_hdr), "ETag: %s\r\n", etag);
+
+	/* Events are sent as they come, they are not compressed. */
+	if (stream->type == OG_STREAM_EVENTS)
+		type_hdr = "Content-Type: text/event-stream\r\n"
+			   "Cache-Control: no-cache\r\n";
+	else if (cli->encoding != OG_ENCODING_IDENTITY) {
+		if (og_deflate_init(&stream->zs, cli->encoding) < 0) {
+			og_client_stream_free(cli);
+			return og_server_internal_error(cli);
 		}
+		stream->deflate = true;
+		snprintf(stream->etag, sizeof(stream->etag), "%s", etag);
+		snprintf(encoding_hdr, sizeof(encoding_hdr),
+			 "Content-Encoding: %s\r\n",
+			 og_encoding_str[cli->encoding]);
 	}
 
-	if (!strncmp(cmd, "clients", strlen("clients"))) {
-		if (method != OG_METHOD_POST &&
-		    method != OG_METHOD_GET)
-			return og_client_method_not_found(cli);
+	if (og_buffer_printf(&stream->out,
+			     "HTTP/1.1 200 OK\r\n%s%s%s"
+			     "Vary: Accept-Encoding\r\n"
+			     "Transfer-Encoding: chunked\r\n\r\n",
+			     type_hdr, etag_hdr, encoding_hdr) < 0) {
+		og_client_stream_free(cli);
+		return og_server_internal_error(cli);
+	}
 
-		if (method == OG_METHOD_POST && !root) {
-			syslog(LOG_ERR, "command clients with no payload\n");
-			return og_client_bad_request(cli);
-		}
-		switch (method) {
-		case OG_METHOD_POST:
-			err = og_cmd_post_clients(root, &params);
-			break;
-		case OG_METHOD_GET:
-			err = og_cmd_get_clients(root, &params, buf_reply);
-			break;
-		default:
-			return og_client_bad_request(cli);
-		}
-	} else if (!strncmp(cmd, "wol", strlen("wol"))) {
-		if (method != OG_METHOD_POST)
-			return og_client_method_not_found(cli);
+	return 1;
+}
 
-		if (!root) {
-			syslog(LOG_ERR, "command wol with no payload\n");
-			return og_client_bad_request(cli);
-		}
-		err = og_cmd_wol(root, &params);
-	} else if (!strncmp(cmd, "shell/run", strlen("shell/run"))) {
-		if (method != OG_METHOD_POST)
-			return og_client_method_not_found(cli);
+static time_t og_etag_epoch;
 
-		if (!root) {
-			syslog(LOG_ERR, "command run with no payload\n");
-			return og_client_bad_request(cli);
+/* Entity tag for the GET /clients, GET /scopes and POST /schedule/get
+ * replies, these are built from the version counter of the client registry,
+ * the scope tree and the schedule set. The clients query string and the
+ * schedule request body are also part of the tag since they select what is
+ * listed. Compressed replies get their own tag.
+ */
+static bool og_rest_etag(enum og_rest_method method, const char *cmd,
+			 const char *body, unsigned int body_len,
+			 enum og_encoding encoding, char *etag, size_t etag_len)
+{
+	uint32_t version, hash = 0;
+	const char *query;
+	char kind;
+
+	if (method == OG_METHOD_GET &&
+	    !strncmp(cmd, "clients", strlen("clients")) &&
+	    strchr(" ?", cmd[strlen("clients")])) {
+		kind = 'c';
+		version = og_client_version;
+		query = cmd + strlen("clients");
+		if (*query == '?') {
+			/* Rooms and centers are taken from the scope tree. */
+			if (og_scope_refresh() < 0)
+				return false;
+
+			hash = og_hash(query, strcspn(query, " "));
+			hash = og_hash_update(hash, &og_scope_tree.version,
+					      sizeof(og_scope_tree.version));
 		}
-		err = og_cmd_run_post(root, &params);
-	} else if (!strncmp(cmd, "shell/output", strlen("shell/output"))) {
-		if (method != OG_METHOD_POST)
-			return og_client_method_not_found(cli);
+	} else if (method == OG_METHOD_GET &&
+		   !strncmp(cmd, "scopes", strlen("scopes"))) {
+		if (og_scope_refresh() < 0)
+			return false;
+
+		kind = 's';
+		version = og_scope_tree.version;
+	} else if (method == OG_METHOD_POST &&
+		   !strncmp(cmd, "schedule/get", strlen("schedule/get"))) {
+		kind = 'p';
+		version = og_schedule_version;
+		hash = og_hash(body, body_len);
+	} else {
+		return false;
+	}
 
-		if (!root) {
-			syslog(LOG_ERR, "command output with no payload\n");
-			return og_client_bad_request(cli);
-		}
+	if (!og_etag_epoch)
+		og_etag_epoch = time(NULL);
 
-		err = og_cmd_run_get(root, &params, buf_reply);
-	} else if (!strncmp(cmd, "session", strlen("session"))) {
-		if (method != OG_METHOD_POST)
-			return og_client_method_not_found(cli);
+	snprintf(etag, etag_len, "\"%c%lx-%x-%x%s%s\"",
+		 kind, (unsigned long)og_etag_epoch, version, hash,
+		 encoding != OG_ENCODING_IDENTITY ? "-" : "",
+		 encoding != OG_ENCODING_IDENTITY ? og_encoding_str[encoding] : "");
 
-		if (!root) {
-			syslog(LOG_ERR, "command session with no payload\n");
-			return og_client_bad_request(cli);
-		}
-		err = og_cmd_session(root, &params);
-	} else if (!strncmp(cmd, "scopes", strlen("scopes"))) {
-		if (method != OG_METHOD_GET)
-			return og_client_method_not_found(cli);
+	return true;
+}
 
-		err = og_cmd_scope_get(root, &params, buf_reply);
-	} else if (!strncmp(cmd, "poweroff", strlen("poweroff"))) {
-		if (method != OG_METHOD_POST)
-			return og_client_method_not_found(cli);
+static bool og_rest_etag_match(const char *if_none_match, const char *etag)
+{
+	if (!if_none_match[0])
+		return false;
 
-		if (!root) {
-			syslog(LOG_ERR, "command poweroff with no payload\n");
-			return og_client_bad_request(cli);
-		}
-		err = og_cmd_poweroff(root, &params);
-	} else if (!strncmp(cmd, "reboot", strlen("reboot"))) {
-		if (method != OG_METHOD_POST)
-			return og_client_method_not_found(cli);
+	return !strcmp(if_none_match, "*") || strstr(if_none_match, etag);
+}
 
-		if (!root) {
-			syslog(LOG_ERR, "command reboot with no payload\n");
-			return og_client_bad_request(cli);
-		}
-		err = og_cmd_reboot(root, &params);
-	} else if (!strncmp(cmd, "stop", strlen("stop"))) {
-		if (method != OG_METHOD_POST)
-			return og_client_method_not_found(cli);
+/* Handler for one method of a route. Commands only report success, replies
+ * are either dumped into og_buffer or streamed through the client.
+ */
+struct og_rest_handler {
+	int	(*cmd)(json_t *element, struct og_msg_params *params);
+	int	(*reply)(json_t *element, struct og_msg_params *params,
+			 struct og_buffer *og_buffer);
+	int	(*stream)(json_t *element, struct og_msg_params *params,
+			  struct og_client *cli);
+	bool	payload;
+};
 
-		if (!root) {
-			syslog(LOG_ERR, "command stop with no payload\n");
-			return og_client_bad_request(cli);
-		}
-		err = og_cmd_stop(root, &params);
-	} else if (!strncmp(cmd, "refresh", strlen("refresh"))) {
-		if (method != OG_METHOD_POST)
-			return og_client_method_not_found(cli);
+struct og_rest_route {
+	const char		*path;
+	struct og_rest_handler	handler[OG_METHOD_NO_HTTP];
+};
 
-		if (!root) {
-			syslog(LOG_ERR, "command refresh with no payload\n");
-			return og_client_bad_request(cli);
-		}
-		err = og_cmd_refresh(root, &params);
-	} else if (!strncmp(cmd, "hardware", strlen("hardware"))) {
-		if (method != OG_METHOD_POST)
-			return og_client_method_not_found(cli);
+#define OG_REST_GET(_type, _fn)					\
+	[OG_METHOD_GET]	 = { ._type = _fn }
+#define OG_REST_POST(_type, _fn)				\
+	[OG_METHOD_POST] = { ._type = _fn, .payload = true }
+
+/* Paths are matched exactly, a route is never shadowed by a shorter one. */
+static const struct og_rest_route og_rest_routes[] = {
+	{ "clients",			{ OG_REST_GET(stream, og_cmd_get_clients),
+					  OG_REST_POST(cmd, og_cmd_post_clients) } },
+	{ "clients/events",		{ OG_REST_GET(stream, og_cmd_get_clients_events) } },
+	{ "wol",			{ OG_REST_POST(cmd, og_cmd_wol) } },
+	{ "wol/status",			{ OG_REST_GET(reply, og_cmd_wol_status) } },
+	{ "shell/run",			{ OG_REST_POST(cmd, og_cmd_run_post) } },
+	{ "shell/output",		{ OG_REST_POST(reply, og_cmd_run_get) } },
+	{ "session",			{ OG_REST_POST(cmd, og_cmd_session) } },
+	{ "scopes",			{ OG_REST_GET(stream, og_cmd_scope_get) } },
+	{ "poweroff",			{ OG_REST_POST(cmd, og_cmd_poweroff) } },
+	{ "reboot",			{ OG_REST_POST(cmd, og_cmd_reboot) } },
+	{ "stop",			{ OG_REST_POST(cmd, og_cmd_stop) } },
+	{ "refresh",			{ OG_REST_POST(cmd, og_cmd_refresh) } },
+	{ "hardware",			{ OG_REST_POST(cmd, og_cmd_hardware) } },
+	{ "software",			{ OG_REST_POST(cmd, og_cmd_software) } },
+	{ "image/create",		{ OG_REST_POST(cmd, og_cmd_create_image) } },
+	{ "image/create/basic",		{ OG_REST_POST(cmd, og_cmd_create_basic_image) } },
+	{ "image/create/incremental",	{ OG_REST_POST(cmd, og_cmd_create_incremental_image) } },
+	{ "image/restore",		{ OG_REST_POST(cmd, og_cmd_restore_image) } },
+	{ "image/restore/basic",	{ OG_REST_POST(cmd, og_cmd_restore_basic_image) } },
+	{ "image/restore/incremental",	{ OG_REST_POST(cmd, og_cmd_restore_incremental_image) } },
+	{ "setup",			{ OG_REST_POST(cmd, og_cmd_setup) } },
+	{ "run/schedule",		{ OG_REST_POST(cmd, og_cmd_run_schedule) } },
+	{ "task/run",			{ OG_REST_POST(cmd, og_cmd_task_post) } },
+	{ "schedule/create",		{ OG_REST_POST(cmd, og_cmd_schedule_create) } },
+	{ "schedule/delete",		{ OG_REST_POST(cmd, og_cmd_schedule_delete) } },
+	{ "schedule/update",		{ OG_REST_POST(cmd, og_cmd_schedule_update) } },
+	{ "schedule/get",		{ [OG_METHOD_POST] = { .stream = og_cmd_schedule_get } } },
+};
 
-		if (!root) {
-			syslog(LOG_ERR, "command hardware with no payload\n");
-			return og_client_bad_request(cli);
-		}
-		err = og_cmd_hardware(root, &params);
-	} else if (!strncmp(cmd, "software", strlen("software"))) {
-		if (method != OG_METHOD_POST)
-			return og_client_method_not_found(cli);
+/* Open addressing index on the route path, it is kept at most half full. */
+#define OG_REST_ROUTE_HASH_SIZE	64
 
-		if (!root) {
-			syslog(LOG_ERR, "command software with no payload\n");
-			return og_client_bad_request(cli);
-		}
-		err = og_cmd_software(root, &params);
-	} else if (!strncmp(cmd, "image/create/basic",
-			    strlen("image/create/basic"))) {
-		if (method != OG_METHOD_POST)
-			return og_client_method_not_found(cli);
+static const struct og_rest_route *og_rest_route_hash[OG_REST_ROUTE_HASH_SIZE];
+static bool og_rest_route_ready;
 
-		if (!root) {
-			syslog(LOG_ERR, "command create with no payload\n");
-			return og_client_bad_request(cli);
-		}
-		err = og_cmd_create_basic_image(root, &params);
-	} else if (!strncmp(cmd, "image/create/incremental",
-			    strlen("image/create/incremental"))) {
-		if (method != OG_METHOD_POST)
-			return og_client_method_not_found(cli);
+static void og_rest_route_init(void)
+{
+	const struct og_rest_route *route;
+	uint32_t idx;
+	unsigned int i;
 
-		if (!root) {
-			syslog(LOG_ERR, "command create with no payload\n");
-			return og_client_bad_request(cli);
-		}
-		err = og_cmd_create_incremental_image(root, &params);
-	} else if (!strncmp(cmd, "image/create", strlen("image/create"))) {
-		if (method != OG_METHOD_POST)
-			return og_client_method_not_found(cli);
+	for (i = 0; i < sizeof(og_rest_routes) / sizeof(og_rest_routes[0]); i++) {
+		route = &og_rest_routes[i];
+		idx = og_hash(route->path, strlen(route->path));
 
-		if (!root) {
-			syslog(LOG_ERR, "command create with no payload\n");
-			return og_client_bad_request(cli);
-		}
-		err = og_cmd_create_image(root, &params);
-	} else if (!strncmp(cmd, "image/restore/basic",
-				strlen("image/restore/basic"))) {
-		if (method != OG_METHOD_POST)
-			return og_client_method_not_found(cli);
+		while (og_rest_route_hash[idx % OG_REST_ROUTE_HASH_SIZE])
+			idx++;
 
-		if (!root) {
-			syslog(LOG_ERR, "command create with no payload\n");
-			return og_client_bad_request(cli);
-		}
-		err = og_cmd_restore_basic_image(root, &params);
-	} else if (!strncmp(cmd, "image/restore/incremental",
-				strlen("image/restore/incremental"))) {
-		if (method != OG_METHOD_POST)
-			return og_client_method_not_found(cli);
+		og_rest_route_hash[idx % OG_REST_ROUTE_HASH_SIZE] = route;
+	}
+	og_rest_route_ready = true;
+}
 
-		if (!root) {
-			syslog(LOG_ERR, "command create with no payload\n");
-			return og_client_bad_request(cli);
-		}
-		err = og_cmd_restore_incremental_image(root, &params);
-	} else if (!strncmp(cmd, "image/restore", strlen("image/restore"))) {
-		if (method != OG_METHOD_POST)
-			return og_client_method_not_found(cli);
+static const struct og_rest_route *og_rest_route_find(const char *path,
+						       size_t len)
+{
+	const struct og_rest_route *route;
+	uint32_t idx;
 
-		if (!root) {
-			syslog(LOG_ERR, "command create with no payload\n");
-			return og_client_bad_request(cli);
-		}
-		err = og_cmd_restore_image(root, &params);
-	} else if (!strncmp(cmd, "setup", strlen("setup"))) {
-		if (method != OG_METHOD_POST)
-			return og_client_method_not_found(cli);
+	if (!og_rest_route_ready)
+		og_rest_route_init();
 
-		if (!root) {
-			syslog(LOG_ERR, "command create with no payload\n");
-			return og_client_bad_request(cli);
-		}
-		err = og_cmd_setup(root, &params);
-	} else if (!strncmp(cmd, "run/schedule", strlen("run/schedule"))) {
-		if (method != OG_METHOD_POST)
-			return og_client_method_not_found(cli);
+	for (idx = og_hash(path, len);
+	     (route = og_rest_route_hash[idx % OG_REST_ROUTE_HASH_SIZE]);
+	     idx++) {
+		if (!strncmp(route->path, path, len) && !route->path[len])
+			return route;
+	}
 
-		if (!root) {
-			syslog(LOG_ERR, "command create with no payload\n");
-			return og_client_bad_request(cli);
-		}
+	return NULL;
+}
 
-		err = og_cmd_run_schedule(root, &params);
-	} else if (!strncmp(cmd, "task/run", strlen("task/run"))) {
-		if (method != OG_METHOD_POST)
-			return og_client_method_not_found(cli);
+static int og_client_process_rest(struct og_client *cli,
+				  enum og_rest_method method, const char *cmd,
+				  char *body, struct og_msg_params *params,
+				  struct og_buffer *og_buffer,
+				  const char *etag)
+{
+	const struct og_rest_handler *handler;
+	const struct og_rest_route *route;
+	json_error_t json_err;
+	json_t *root = NULL;
+	size_t len;
+	int err;
 
-		if (!root) {
-			syslog(LOG_ERR, "command task with no payload\n");
-			return og_client_bad_request(cli);
-		}
-		err = og_cmd_task_post(root, &params);
-	} else if (!strncmp(cmd, "schedule/create",
-			    strlen("schedule/create"))) {
-		if (method != OG_METHOD_POST)
-			return og_client_method_not_found(cli);
+	len = strcspn(cmd, " ?");
+	route = og_rest_route_find(cmd, len);
+	if (!route) {
+		syslog(LOG_ERR, "unknown command: %.32s ...\n", cmd);
+		return og_client_not_found(cli);
+	}
 
-		if (!root) {
-			syslog(LOG_ERR, "command task with no payload\n");
-			return og_client_bad_request(cli);
-		}
-		err = og_cmd_schedule_create(root, &params);
-	} else if (!strncmp(cmd, "schedule/delete",
-			    strlen("schedule/delete"))) {
-		if (method != OG_METHOD_POST)
-			return og_client_method_not_found(cli);
+	if (cmd[len] == '?') {
+		params->query = cmd + len + 1;
+		params->query_len = strcspn(params->query, " ");
+	}
 
-		if (!root) {
-			syslog(LOG_ERR, "command task with no payload\n");
-			return og_client_bad_request(cli);
-		}
-		err = og_cmd_schedule_delete(root, &params);
-	} else if (!strncmp(cmd, "schedule/update",
-			    strlen("schedule/update"))) {
-		if (method != OG_METHOD_POST)
-			return og_client_method_not_found(cli);
+	handler = &route->handler[method];
+	if (!handler->cmd && !handler->reply && !handler->stream)
+		return og_client_method_not_found(cli);
+
+	if (cli->content_length) {
+		if (og_rest_parse_clients(body, params) < 0)
+			return og_server_internal_error(cli);
 
+		root = json_loads(body, 0, &json_err);
 		if (!root) {
-			syslog(LOG_ERR, "command task with no payload\n");
-			return og_client_bad_request(cli);
+			syslog(LOG_ERR, "malformed json line %d: %s\n",
+			       json_err.line, json_err.text);
+			return og_client_not_found(cli);
 		}
-		err = og_cmd_schedule_update(root, &params);
-	} else if (!strncmp(cmd, "schedule/get",
-			    strlen("schedule/get"))) {
-		if (method != OG_METHOD_POST)
-			return og_client_method_not_found(cli);
-
-		err = og_cmd_schedule_get(root, &params, buf_reply);
-	} else {
-		syslog(LOG_ERR, "unknown command: %.32s ...\n", cmd);
-		err = og_client_not_found(cli);
+	} else if (handler->payload) {
+		syslog(LOG_ERR, "command %s with no payload\n", route->path);
+		return og_client_bad_request(cli);
 	}
 
+	if (handler->cmd)
+		err = handler->cmd(root, params);
+	else if (handler->reply)
+		err = handler->reply(root, params, og_buffer);
+	else
+		err = handler->stream(root, params, cli);
+
 	if (root)
 		json_decref(root);
 
 	if (err < 0)
 		return og_client_bad_request(cli);
 
-	err = og_client_ok(cli, buf_reply);
-	if (err < 0) {
-		syslog(LOG_ERR, "HTTP response to %s:%hu is too large\n",
-		       inet_ntoa(cli->addr.sin_addr),
-		       ntohs(cli->addr.sin_port));
+	if (cli->stream)
+		return og_client_stream_start(cli, etag);
+
+	return og_client_ok(cli, og_buffer, etag);
+}
+
+int og_client_state_process_payload_rest(struct og_client *cli)
+{
+	char etag[OG_ETAG_MAXLEN] = {};
+	const struct og_buffer *cached;
+	struct og_buffer og_buffer = {};
+	struct og_msg_params *params;
+	struct og_arena arena = {};
+	enum og_rest_method method;
+	const char *cmd;
+	char *body;
+	int err;
+
+	syslog(LOG_DEBUG, "%s:%hu %.32s ...\n",
+	       inet_ntoa(cli->addr.sin_addr),
+	       ntohs(cli->addr.sin_port), cli->buf);
+
+	if (!strncmp(cli->buf, "GET", strlen("GET"))) {
+		method = OG_METHOD_GET;
+		cmd = cli->buf + strlen("GET") + 2;
+	} else if (!strncmp(cli->buf, "POST", strlen("POST"))) {
+		method = OG_METHOD_POST;
+		cmd = cli->buf + strlen("POST") + 2;
+	} else
+		return og_client_method_not_found(cli);
+
+	body = strstr(cli->buf, "\r\n\r\n") + 4;
+
+	if (strcmp(cli->auth_token, auth_token)) {
+		syslog(LOG_ERR, "wrong Authentication key\n");
+		return og_client_not_authorized(cli);
+	}
+
+	if (og_rest_etag(method, cmd, body, cli->content_length,
+			 cli->encoding, etag, sizeof(etag))) {
+		if (og_rest_etag_match(cli->if_none_match, etag))
+			return og_client_not_modified(cli, etag);
+
+		cached = og_deflate_cache_find(etag);
+		if (cached)
+			return og_client_send_reply(cli, cached, etag,
+						    cli->encoding);
 	}
 
+	params = og_arena_zalloc(&arena, sizeof(*params));
+	if (!params)
+		return og_server_internal_error(cli);
+
+	params->arena = &arena;
+	og_json_set_arena(&arena);
+
+	err = og_client_process_rest(cli, method, cmd, body, params,
+				     &og_buffer, etag);
+	og_json_set_arena(NULL);
+	og_arena_free(&arena);
+	free(og_buffer.data);
+
 	return err;
 }
@@ -37,6 +37,15 @@ enum og_cmd_type {
 };
 
 #define OG_MSG_REQUEST_MAXLEN	65536
+#define OG_ETAG_MAXLEN		64
+
+enum og_encoding {
+	OG_ENCODING_IDENTITY	= 0,
+	OG_ENCODING_GZIP,
+	OG_ENCODING_DEFLATE,
+};
+
+struct og_stream;
 
 struct og_client {
 	struct list_head	list;
@@ -52,13 +61,21 @@ struct og_client {
 	bool			agent;
 	int			content_length;
 	char			auth_token[64];
+	char			if_none_match[OG_ETAG_MAXLEN];
+	enum og_encoding	encoding;
 	enum og_client_status	status;
 	enum og_cmd_type	last_cmd;
 	unsigned int		last_cmd_id;
 	bool			autorun;
+	struct og_stream	*stream;
 };
 
+extern uint32_t og_client_version;
+
 void og_client_add(struct og_client *cli);
+void og_client_del(struct og_client *cli);
+void og_client_changed(struct og_client *cli);
+int og_client_shell_output(struct og_client *cli, const char *data, size_t len);
 
 static inline int og_client_socket(const struct og_client *cli)
 {
@@ -66,8 +83,12 @@ static inline int og_client_socket(const struct og_client *cli)
 }
 
 #include "json.h"
+#include "wol.h"
 
 int og_client_state_process_payload_rest(struct og_client *cli);
+int og_client_stream_send(struct og_client *cli);
+void og_client_stream_wake(struct og_client *cli);
+void og_client_stream_free(struct og_client *cli);
 
 enum og_rest_method {
 	OG_METHOD_GET	= 0,
@@ -79,20 +100,29 @@ int og_send_request(enum og_rest_method method, enum og_cmd_type type,
 		    const struct og_msg_params *params,
 		    const json_t *data);
 
+/* Serialized command payload, shared by all the commands that are queued
+ * from the very same action.
+ */
+struct og_cmd_payload {
+	unsigned int		refcnt;
+	unsigned int		len;
+	char			data[];
+};
+
 struct og_cmd {
 	uint32_t		id;
 	struct list_head	list;
 	uint32_t		client_id;
-	const char		*ip;
-	const char		*mac;
+	struct in_addr		addr;
 	enum og_cmd_type	type;
 	enum og_rest_method	method;
-	struct og_msg_params	params;
-	json_t			*json;
+	struct og_cmd_payload	*payload;
+	struct og_wol_target	wol;
 };
 
-const struct og_cmd *og_cmd_find(const char *client_ip);
+const struct og_cmd *og_cmd_find(struct in_addr addr);
 void og_cmd_free(const struct og_cmd *cmd);
+int og_cmd_send(struct og_client *cli, const struct og_cmd *cmd);
 
 extern char auth_token[LONPRM];
 
@@ -7,7 +7,7 @@
  */
 
 #include "schedule.h"
-#include "list.h"
+#include "utils.h"
 #include <sys/types.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -17,432 +17,497 @@
 #include <ev.h>
 
 struct og_schedule *current_schedule = NULL;
-static LIST_HEAD(schedule_list);
+uint32_t og_schedule_version;
 
-static void og_schedule_add(struct og_schedule *new)
-{
-	struct og_schedule *schedule, *next;
+/* Pending schedules, this is a binary min-heap ordered by firing time. */
+static struct {
+	struct og_schedule	**array;
+	unsigned int		len;
+	unsigned int		size;
+	unsigned int		seq;
+} schedule_heap;
 
-	list_for_each_entry_safe(schedule, next, &schedule_list, list) {
-		if (new->seconds < schedule->seconds) {
-			list_add_tail(&new->list, &schedule->list);
-			return;
-		}
-	}
-	list_add_tail(&new->list, &schedule_list);
-}
+/* Schedules indexed by schedule_id, for update and delete. */
+#define OG_SCHEDULE_HASH_SIZE	256
 
-/* Returns the days in a month from the weekday. */
-static void get_days_from_weekday(struct tm *tm, int wday, int *days, int *j)
+static struct list_head schedule_hash[OG_SCHEDULE_HASH_SIZE];
+
+static struct list_head *og_schedule_hash_bucket(uint32_t schedule_id)
 {
-	int i, mday = 0;
+	struct list_head *bucket;
 
-	tm->tm_mday = 1;
+	bucket = &schedule_hash[og_hash(&schedule_id, sizeof(schedule_id)) %
+				OG_SCHEDULE_HASH_SIZE];
+	if (!bucket->next)
+		INIT_LIST_HEAD(bucket);
 
-	//Shift week to start on Sunday instead of Monday
-	if (wday == 6)
-		wday = 0;
-	else
-		wday++;
-
-	/* A bit bruteforce, but simple. */
-	for (i = 0; i <= 30; i++) {
-		mktime(tm);
-		/* Not this weekday, skip. */
-		if (tm->tm_wday != wday) {
-			tm->tm_mday++;
-			continue;
-		}
-		/* Not interested in next month. */
-		if (tm->tm_mday < mday)
-			break;
-
-		/* Found a matching. */
-		mday = tm->tm_mday;
-		days[(*j)++] = tm->tm_mday;
-		tm->tm_mday++;
-	}
+	return bucket;
 }
 
-/* Returns the days in the given week. */
-static void get_days_from_week(struct tm *tm, int week, int *days, int *k)
+static struct og_schedule *og_schedule_lookup(uint32_t schedule_id)
 {
-	int i, j, week_counter = 0;
-	bool week_over = false;
+	struct list_head *bucket = og_schedule_hash_bucket(schedule_id);
+	struct og_schedule *schedule;
 
-	tm->tm_mday = 1;
+	list_for_each_entry(schedule, bucket, hash_list) {
+		if (schedule->schedule_id == schedule_id)
+			return schedule;
+	}
 
-	/* Remaining days of this month. */
-	for (i = 0; i <= 30; i++) {
-		mktime(tm);
+	return NULL;
+}
 
-		/* Last day of this week? */
-		if (tm->tm_wday == 6)
-			week_over = true;
+static void og_schedule_free(struct og_schedule *schedule)
+{
+	list_del(&schedule->hash_list);
+	free(schedule);
+}
 
-		/* Not the week we are searching for. */
-		if (week != week_counter) {
-			tm->tm_mday++;
-			if (week_over) {
-				week_counter++;
-				week_over = false;
-			}
-			continue;
-		}
+static bool og_schedule_before(const struct og_schedule *a,
+			       const struct og_schedule *b)
+{
+	if (a->seconds != b->seconds)
+		return a->seconds < b->seconds;
 
-		/* Found matching. */
-		for (j = tm->tm_wday; j <= 6; j++) {
-			days[(*k)++] = tm->tm_mday++;
-			mktime(tm);
-		}
-		break;
-	}
+	/* Same firing time, preserve insertion order. */
+	return a->seq < b->seq;
 }
 
-static int monthdays[12] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
-
-static int last_month_day(struct tm *tm)
+static void og_schedule_heap_set(unsigned int idx, struct og_schedule *schedule)
 {
-	/* Leap year? Adjust it. */
-	if (tm->tm_mon == 1) {
-		tm->tm_mday = 29;
-		mktime(tm);
-		if (tm->tm_mday == 29)
-			return 29;
-
-		tm->tm_mon = 1;
-	}
-
-	return monthdays[tm->tm_mon];
+	schedule_heap.array[idx] = schedule;
+	schedule->heap_idx = idx;
 }
 
-/* Returns the days in the given week. */
-static void get_last_week(struct tm *tm, int *days, int *j)
+static void og_schedule_heap_up(unsigned int idx)
 {
-	int i, last_day;
+	struct og_schedule *schedule = schedule_heap.array[idx];
+	unsigned int parent;
 
-	last_day = last_month_day(tm);
-	tm->tm_mday = last_day;
+	while (idx > 0) {
+		parent = (idx - 1) / 2;
+		if (!og_schedule_before(schedule, schedule_heap.array[parent]))
+			break;
 
-	for (i = last_day; i >= last_day - 6; i--) {
-		mktime(tm);
+		og_schedule_heap_set(idx, schedule_heap.array[parent]);
+		idx = parent;
+	}
+	og_schedule_heap_set(idx, schedule);
+}
 
-		days[(*j)++] = tm->tm_mday;
+static void og_schedule_heap_down(unsigned int idx)
+{
+	struct og_schedule *schedule = schedule_heap.array[idx];
+	unsigned int child;
 
+	while ((child = 2 * idx + 1) < schedule_heap.len) {
+		if (child + 1 < schedule_heap.len &&
+		    og_schedule_before(schedule_heap.array[child + 1],
+				       schedule_heap.array[child]))
+			child++;
 
-		/* Last day of this week? */
-		if (tm->tm_wday == 1)
+		if (!og_schedule_before(schedule_heap.array[child], schedule))
 			break;
 
-		tm->tm_mday--;
+		og_schedule_heap_set(idx, schedule_heap.array[child]);
+		idx = child;
 	}
+	og_schedule_heap_set(idx, schedule);
 }
 
-static void og_parse_years(uint16_t years_mask, int years[])
+static int og_schedule_add(struct og_schedule *new)
 {
-	int i, j = 0;
-
-	for (i = 0; i < 16; i++) {
-		if ((1 << i) & years_mask)
-			years[j++] = 2010 + i - 1900;
+	struct og_schedule **array;
+	unsigned int size;
+
+	if (schedule_heap.len == schedule_heap.size) {
+		size = schedule_heap.size ? schedule_heap.size * 2 : 64;
+		array = realloc(schedule_heap.array,
+				size * sizeof(struct og_schedule *));
+		if (!array)
+			return -1;
+
+		schedule_heap.array = array;
+		schedule_heap.size = size;
 	}
+
+	new->seq = schedule_heap.seq++;
+	og_schedule_heap_set(schedule_heap.len++, new);
+	og_schedule_heap_up(new->heap_idx);
+
+	return 0;
 }
 
-static void og_parse_months(uint16_t months_mask, int months[])
+static void og_schedule_del(struct og_schedule *schedule)
 {
-	int i, j = 0;
+	unsigned int idx = schedule->heap_idx;
+	struct og_schedule *last;
 
-	for (i = 0; i < 12; i++) {
-		if ((1 << i) & months_mask)
-			months[j++] = i + 1;
-	}
+	last = schedule_heap.array[--schedule_heap.len];
+	if (last == schedule)
+		return;
+
+	og_schedule_heap_set(idx, last);
+	if (idx > 0 &&
+	    og_schedule_before(last, schedule_heap.array[(idx - 1) / 2]))
+		og_schedule_heap_up(idx);
+	else
+		og_schedule_heap_down(idx);
 }
 
-static void og_parse_days(uint32_t days_mask, int *days)
+static struct og_schedule *og_schedule_first(void)
 {
-	int i, j = 0;
+	if (!schedule_heap.len)
+		return NULL;
 
-	for (i = 0; i < 31; i++) {
-		if ((1 << i) & days_mask)
-			days[j++] = i + 1;
-	}
+	return schedule_heap.array[0];
 }
 
-static void og_parse_hours(uint16_t hours_mask, uint8_t am_pm, int hours[])
+#define OG_SCHEDULE_YEAR_BASE	2010
+#define OG_SCHEDULE_LAST_WEEK	5
+
+static const int monthdays[12] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+
+static bool og_leap_year(int year)
 {
-	int pm = 12 * am_pm;
-	int i, j = 0;
+	return (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+}
 
-	for (i = 0; i < 12; i++) {
-		if ((1 << i) & hours_mask)
-			hours[j++] = i + pm + 1;
-	}
+/* Year is in calendar years, month is in the 0..11 range. */
+static int og_month_days(int year, int month)
+{
+	if (month == 1 && og_leap_year(year))
+		return 29;
+
+	return monthdays[month];
 }
 
-static void og_schedule_remove_duplicates()
+/* Zeller's congruence, returns the weekday (0 is Sunday) like tm_wday. */
+static int og_week_day(int year, int month, int mday)
 {
-	struct og_schedule *schedule, *next, *prev = NULL;
+	int m = month + 1, k, j, h;
 
-	list_for_each_entry_safe(schedule, next, &schedule_list, list) {
-		if (!prev) {
-			prev = schedule;
-			continue;
-		}
-		if (prev->seconds == schedule->seconds &&
-		    prev->task_id == schedule->task_id) {
-			list_del(&prev->list);
-			free(prev);
-		}
-		prev = schedule;
+	/* January and February are months 13 and 14 of the previous year. */
+	if (m < 3) {
+		m += 12;
+		year--;
 	}
+	k = year % 100;
+	j = year / 100;
+	h = (mday + (13 * (m + 1)) / 5 + k + k / 4 + j / 4 + 5 * j) % 7;
+
+	/* Zeller's h is 0 for Saturday. */
+	return (h + 6) % 7;
 }
 
-static bool og_schedule_stale(time_t seconds)
+/* Returns the mask of days from first to last (both included, 1-based). */
+static uint32_t og_days_range(int first, int last)
 {
-	time_t now;
-
-	now = time(NULL);
-	if (seconds < now)
-		return true;
+	if (first > last)
+		return 0;
 
-	return false;
+	return (UINT32_MAX >> (32 - (last - first + 1))) << (first - 1);
 }
 
-static void og_schedule_create_weekdays(int month, int year,
-					int *hours, int minutes, int week_days,
-					uint32_t task_id, uint32_t schedule_id,
-					enum og_schedule_type type,
-					bool on_start)
+/* Returns the mask of days in this month that match the schedule. Weeks start
+ * on Sunday, except for the last week which starts on the last Monday. Week
+ * days bits start on Monday.
+ */
+static uint32_t og_schedule_month_days(const struct og_schedule_time *time,
+				       int year, int month)
 {
-	struct og_schedule *schedule;
-	int month_days[5];
-	int n_month_days;
-	time_t seconds;
-	uint32_t wday;
-	struct tm tm;
-	int k, l;
+	int last_day, first_wday, wday, mday, week, start, end;
+	uint32_t days_mask;
+
+	last_day = og_month_days(year, month);
+	first_wday = og_week_day(year, month, 1);
+	days_mask = time->days & og_days_range(1, last_day);
 
 	for (wday = 0; wday < 7; wday++) {
-		if (!((1 << wday) & week_days))
+		if (!((1 << wday) & time->week_days))
 			continue;
 
-		memset(&tm, 0, sizeof(tm));
-		tm.tm_mon = month;
-		tm.tm_year = year;
-
-		n_month_days = 0;
-		memset(month_days, 0, sizeof(month_days));
-		get_days_from_weekday(&tm, wday, month_days, &n_month_days);
-
-		for (k = 0; month_days[k] != 0 && k < n_month_days; k++) {
-			for (l = 0; hours[l] != 0 && l < 31; l++) {
-				memset(&tm, 0, sizeof(tm));
-				tm.tm_year = year;
-				tm.tm_mon = month;
-				tm.tm_mday = month_days[k];
-				tm.tm_hour = hours[l] - 1;
-				tm.tm_min = minutes;
-				seconds = mktime(&tm);
-
-				if (on_start && og_schedule_stale(seconds))
-					continue;
+		mday = 1 + ((wday + 1) % 7 - first_wday + 7) % 7;
+		for (; mday <= last_day; mday += 7)
+			days_mask |= 1U << (mday - 1);
+	}
 
-				schedule = (struct og_schedule *)
-					calloc(1, sizeof(struct og_schedule));
-				if (!schedule)
-					return;
+	for (week = 0; week < OG_SCHEDULE_LAST_WEEK; week++) {
+		if (!((1 << week) & time->weeks))
+			continue;
 
-				schedule->seconds = seconds;
-				schedule->task_id = task_id;
-				schedule->schedule_id = schedule_id;
-				schedule->type = type;
-				og_schedule_add(schedule);
-			}
-		}
+		start = week ? 1 + 7 * week - first_wday : 1;
+		end = 7 * (week + 1) - first_wday;
+		if (end > last_day)
+			end = last_day;
+
+		days_mask |= og_days_range(start, end);
+	}
+
+	if ((1 << OG_SCHEDULE_LAST_WEEK) & time->weeks) {
+		wday = (first_wday + last_day - 1) % 7;
+		days_mask |= og_days_range(last_day - (wday + 6) % 7, last_day);
 	}
+
+	return days_mask;
 }
 
-static void og_schedule_create_weeks(int month, int year,
-				     int *hours, int minutes, int weeks,
-				     uint32_t task_id, uint32_t schedule_id,
-				     enum og_schedule_type type, bool on_start)
+/* Compares two broken-down times, returns true if a is before b. */
+static bool og_tm_before(const struct tm *a, const struct tm *b)
 {
-	struct og_schedule *schedule;
-	int month_days[7];
-	int n_month_days;
-	time_t seconds;
-	struct tm tm;
-	int week;
-	int k, l;
+	if (a->tm_year != b->tm_year)
+		return a->tm_year < b->tm_year;
+	if (a->tm_mon != b->tm_mon)
+		return a->tm_mon < b->tm_mon;
+	if (a->tm_mday != b->tm_mday)
+		return a->tm_mday < b->tm_mday;
+	if (a->tm_hour != b->tm_hour)
+		return a->tm_hour < b->tm_hour;
+	if (a->tm_min != b->tm_min)
+		return a->tm_min < b->tm_min;
+
+	return a->tm_sec < b->tm_sec;
+}
 
-	for (week = 0; week < 5; week++) {
-		if (!((1 << week) & weeks))
+/* Returns the first firing time of this schedule at or after the given time,
+ * zero if there is none. Candidates are compared in broken-down local time,
+ * so mktime() is only called once for the firing that is found.
+ */
+static time_t og_schedule_time_next(const struct og_schedule_time *time,
+				    time_t after)
+{
+	int year, month, day, hour, tm_year;
+	struct tm tm, after_tm;
+	uint32_t days_mask;
+
+	localtime_r(&after, &after_tm);
+
+	for (year = 0; year < 16; year++) {
+		tm_year = OG_SCHEDULE_YEAR_BASE + year - 1900;
+		if (!((1 << year) & time->years) || tm_year < after_tm.tm_year)
 			continue;
 
-		memset(&tm, 0, sizeof(tm));
-		tm.tm_mon = month;
-		tm.tm_year = year;
-
-		n_month_days = 0;
-		memset(month_days, 0, sizeof(month_days));
-		if (week == 5)
-			get_last_week(&tm, month_days, &n_month_days);
-		else
-			get_days_from_week(&tm,  week, month_days, &n_month_days);
-
-		for (k = 0; month_days[k] != 0 && k < n_month_days; k++) {
-			for (l = 0; hours[l] != 0 && l < 31; l++) {
-				memset(&tm, 0, sizeof(tm));
-				tm.tm_year = year;
-				tm.tm_mon = month;
-				tm.tm_mday = month_days[k];
-				tm.tm_hour = hours[l] - 1;
-				tm.tm_min = minutes;
-				seconds = mktime(&tm);
-
-				if (on_start && og_schedule_stale(seconds))
+		for (month = 0; month < 12; month++) {
+			if (!((1 << month) & time->months))
+				continue;
+			if (tm_year == after_tm.tm_year && month < after_tm.tm_mon)
+				continue;
+
+			days_mask = og_schedule_month_days(time, tm_year + 1900,
+							   month);
+
+			for (day = 0; day < 31; day++) {
+				if (!((1U << day) & days_mask))
 					continue;
 
-				schedule = (struct og_schedule *)
-					calloc(1, sizeof(struct og_schedule));
-				if (!schedule)
-					return;
+				for (hour = 0; hour < 12; hour++) {
+					if (!((1 << hour) & time->hours))
+						continue;
+
+					memset(&tm, 0, sizeof(tm));
+					tm.tm_year = tm_year;
+					tm.tm_mon = month;
+					tm.tm_mday = day + 1;
+					tm.tm_hour = hour + 12 * time->am_pm;
+					tm.tm_min = time->minutes;
+					tm.tm_isdst = -1;
+
+					if (og_tm_before(&tm, &after_tm))
+						continue;
 
-				schedule->seconds = seconds;
-				schedule->task_id = task_id;
-				schedule->schedule_id = schedule_id;
-				schedule->type = type;
-				og_schedule_add(schedule);
+					return mktime(&tm);
+				}
 			}
 		}
 	}
+
+	return 0;
 }
 
-static void og_schedule_create_days(int month, int year,
-				    int *hours, int minutes, int *days,
-				    uint32_t task_id, uint32_t schedule_id,
-				    enum og_schedule_type type, bool on_start)
+/* Arm this schedule for its next firing at or after the given time. Returns
+ * false if the schedule has no more firings.
+ */
+static bool og_schedule_arm(struct og_schedule *schedule, time_t after)
 {
-	struct og_schedule *schedule;
-	time_t seconds;
-	struct tm tm;
-	int k, l;
+	schedule->seconds = og_schedule_time_next(&schedule->time, after);
+	if (!schedule->seconds)
+		return false;
 
-	for (k = 0; days[k] != 0 && k < 31; k++) {
-		for (l = 0; hours[l] != 0 && l < 31; l++) {
+	return og_schedule_add(schedule) == 0;
+}
 
-			memset(&tm, 0, sizeof(tm));
-			tm.tm_year = year;
-			tm.tm_mon = month;
-			tm.tm_mday = days[k];
-			tm.tm_hour = hours[l] - 1;
-			tm.tm_min = minutes;
-			seconds = mktime(&tm);
+void og_schedule_create(unsigned int schedule_id, unsigned int task_id,
+			enum og_schedule_type type,
+			struct og_schedule_time *schedule_time)
+{
+	struct og_schedule *schedule;
 
-			if (on_start && og_schedule_stale(seconds))
-				continue;
+	/* The schedule set has changed, even if this one never fires. */
+	og_schedule_version++;
 
-			schedule = (struct og_schedule *)
-				calloc(1, sizeof(struct og_schedule));
-			if (!schedule)
-				return;
+	schedule = (struct og_schedule *)calloc(1, sizeof(struct og_schedule));
+	if (!schedule)
+		return;
 
-			schedule->seconds = seconds;
-			schedule->task_id = task_id;
-			schedule->schedule_id = schedule_id;
-			schedule->type = type;
-			og_schedule_add(schedule);
-		}
+	schedule->task_id = task_id;
+	schedule->schedule_id = schedule_id;
+	schedule->type = type;
+	schedule->time = *schedule_time;
+
+	if (!og_schedule_arm(schedule, time(NULL))) {
+		free(schedule);
+		return;
 	}
+	list_add_tail(&schedule->hash_list, og_schedule_hash_bucket(schedule_id));
 }
 
-void og_schedule_create(unsigned int schedule_id, unsigned int task_id,
-			enum og_schedule_type type,
-			struct og_schedule_time *time)
+/* Unlink this schedule from the heap, stop its timer if it is armed. */
+static void og_schedule_unlink(struct ev_loop *loop,
+			       struct og_schedule *schedule)
 {
-	int year, month, minutes;
-	int months[12] = {};
-	int years[12] = {};
-	int hours[12] = {};
-	int days[31] = {};
-	int i, j;
-
-	og_parse_years(time->years, years);
-	og_parse_months(time->months, months);
-	og_parse_days(time->days, days);
-	og_parse_hours(time->hours, time->am_pm, hours);
-	minutes = time->minutes;
-
-	for (i = 0; years[i] != 0 && i < 12; i++) {
-		for (j = 0; months[j] != 0 && j < 12; j++) {
-			month = months[j] - 1;
-			year = years[i];
-
-			if (time->week_days)
-				og_schedule_create_weekdays(month, year,
-							    hours, minutes,
-							    time->week_days,
-							    task_id,
-							    schedule_id,
-							    type,
-							    time->on_start);
-
-			if (time->weeks)
-				og_schedule_create_weeks(month, year,
-							 hours, minutes,
-							 time->weeks,
-							 task_id,
-							 schedule_id,
-							 type, time->on_start);
-
-			if (time->days)
-				og_schedule_create_days(month, year,
-							hours, minutes,
-							days,
-							task_id,
-							schedule_id,
-							type, time->on_start);
-		}
+	if (current_schedule == schedule) {
+		ev_timer_stop(loop, &schedule->timer);
+		current_schedule = NULL;
 	}
-
-	og_schedule_remove_duplicates();
+	og_schedule_del(schedule);
 }
 
 void og_schedule_delete(struct ev_loop *loop, uint32_t schedule_id)
 {
-	struct og_schedule *schedule, *next;
+	struct og_schedule *schedule;
+	bool refresh = false;
 
-	list_for_each_entry_safe(schedule, next, &schedule_list, list) {
-		if (schedule->schedule_id != schedule_id)
-			continue;
+	og_schedule_version++;
 
-		list_del(&schedule->list);
-		if (current_schedule == schedule) {
-			ev_timer_stop(loop, &schedule->timer);
-			current_schedule = NULL;
-			og_schedule_refresh(loop);
-		}
-		free(schedule);
+	while ((schedule = og_schedule_lookup(schedule_id)) != NULL) {
+		if (current_schedule == schedule)
+			refresh = true;
+
+		og_schedule_unlink(loop, schedule);
+		og_schedule_free(schedule);
 	}
+
+	if (refresh)
+		og_schedule_refresh(loop);
 }
 
 void og_schedule_update(struct ev_loop *loop, unsigned int schedule_id,
-			unsigned int task_id, struct og_schedule_time *time)
+			unsigned int task_id,
+			struct og_schedule_time *schedule_time)
 {
-	og_schedule_delete(loop, schedule_id);
-	og_schedule_create(schedule_id, task_id, OG_SCHEDULE_TASK, time);
+	struct og_schedule *schedule;
+
+	schedule = og_schedule_lookup(schedule_id);
+	if (!schedule) {
+		og_schedule_create(schedule_id, task_id, OG_SCHEDULE_TASK,
+				   schedule_time);
+		return;
+	}
+
+	og_schedule_version++;
+
+	og_schedule_unlink(loop, schedule);
+	schedule->task_id = task_id;
+	schedule->type = OG_SCHEDULE_TASK;
+	schedule->time = *schedule_time;
+
+	if (!og_schedule_arm(schedule, time(NULL)))
+		og_schedule_free(schedule);
 }
 
-static void og_agent_timer_cb(struct ev_loop *loop, ev_timer *timer, int events)
+static int og_schedule_task_cmp(const void *a, const void *b)
+{
+	const struct og_schedule *sa = *(const struct og_schedule **)a;
+	const struct og_schedule *sb = *(const struct og_schedule **)b;
+
+	if (sa->task_id != sb->task_id)
+		return sa->task_id < sb->task_id ? -1 : 1;
+
+	return sa->seq < sb->seq ? -1 : sa->seq > sb->seq;
+}
+
+/* Schedules that fire in the same second, these run as a single job. */
+static struct {
+	struct og_schedule	**array;
+	struct og_schedule_task	*tasks;
+	unsigned int		size;
+} schedule_batch;
+
+/* Both arrays share one block, the tasks go after the schedules, so the batch
+ * is left as it was if the allocation fails.
+ */
+static int og_schedule_batch_grow(void)
 {
-	struct og_schedule *current;
+	unsigned int size = schedule_batch.size ? schedule_batch.size * 2 : 64;
+	struct og_schedule **array;
 
-	current = container_of(timer, struct og_schedule, timer);
-	og_schedule_run(current->task_id, current->schedule_id, current->type);
+	array = realloc(schedule_batch.array,
+			size * (sizeof(struct og_schedule *) +
+				sizeof(struct og_schedule_task)));
+	if (!array)
+		return -1;
 
+	schedule_batch.array = array;
+	schedule_batch.tasks = (struct og_schedule_task *)(array + size);
+	schedule_batch.size = size;
+
+	return 0;
+}
+
+static void og_agent_timer_cb(struct ev_loop *loop, ev_timer *timer, int events)
+{
+	struct og_schedule **done, *next;
+	unsigned int i, len = 0, n_tasks = 0;
+	time_t seconds;
+
+	next = container_of(timer, struct og_schedule, timer);
 	ev_timer_stop(loop, timer);
-	list_del(&current->list);
-	free(current);
+	current_schedule = NULL;
+	seconds = next->seconds;
+
+	/* Collect all schedules for this very same second. */
+	do {
+		if (len == schedule_batch.size &&
+		    og_schedule_batch_grow() < 0) {
+			syslog(LOG_ERR, "OOM while running schedules\n");
+			if (len)
+				break;
+
+			/* Skip this firing instead of retrying it right
+			 * away for as long as there is no memory.
+			 */
+			og_schedule_del(next);
+			if (!og_schedule_arm(next, seconds + 1))
+				og_schedule_free(next);
+			og_schedule_next(loop);
+			return;
+		}
+		og_schedule_del(next);
+		schedule_batch.array[len++] = next;
+	} while ((next = og_schedule_first()) != NULL &&
+		 next->seconds == seconds);
+
+	done = schedule_batch.array;
+
+	/* Run each task only once, even if several schedules refer to it. */
+	qsort(done, len, sizeof(struct og_schedule *), og_schedule_task_cmp);
+	for (i = 0; i < len; i++) {
+		if (i > 0 && done[i]->task_id == done[i - 1]->task_id)
+			continue;
+
+		schedule_batch.tasks[n_tasks].task_id = done[i]->task_id;
+		schedule_batch.tasks[n_tasks].schedule_id = done[i]->schedule_id;
+		schedule_batch.tasks[n_tasks].type = done[i]->type;
+		n_tasks++;
+	}
+	if (n_tasks)
+		og_schedule_run(schedule_batch.tasks, n_tasks);
+
+	/* Re-arm these schedules for their next firing. */
+	for (i = 0; i < len; i++) {
+		if (!og_schedule_arm(done[i], seconds + 1))
+			og_schedule_free(done[i]);
+	}
 
 	og_schedule_next(loop);
 }
@@ -452,12 +517,12 @@ void og_schedule_next(struct ev_loop *loop)
 	struct og_schedule *schedule;
 	time_t now, seconds;
 
-	if (list_empty(&schedule_list)) {
+	schedule = og_schedule_first();
+	if (!schedule) {
 		current_schedule = NULL;
 		return;
 	}
 
-	schedule = list_first_entry(&schedule_list, struct og_schedule, list);
 	now = time(NULL);
 	if (schedule->seconds <= now)
 		seconds = 0;
@@ -16,7 +16,6 @@ struct og_schedule_time {
 	uint32_t	hours;
 	uint32_t	am_pm;
 	uint32_t	minutes;
-	bool		on_start;
 };
 
 enum og_schedule_type {
@@ -26,14 +25,25 @@ enum og_schedule_type {
 };
 
 struct og_schedule {
-	struct list_head	list;
+	struct list_head	hash_list;
+	unsigned int		heap_idx;
+	unsigned int		seq;
 	struct ev_timer		timer;
 	time_t			seconds;
+	struct og_schedule_time	time;
 	unsigned int		task_id;
 	unsigned int		schedule_id;
 	enum og_schedule_type	type;
 };
 
+struct og_schedule_task {
+	unsigned int		task_id;
+	unsigned int		schedule_id;
+	enum og_schedule_type	type;
+};
+
+extern uint32_t og_schedule_version;
+
 void og_schedule_create(unsigned int schedule_id, unsigned int task_id,
 			enum og_schedule_type type,
 			struct og_schedule_time *time);
@@ -42,8 +52,7 @@ void og_schedule_update(struct ev_loop *loop, unsigned int schedule_id,
 void og_schedule_delete(struct ev_loop *loop, uint32_t schedule_id);
 void og_schedule_next(struct ev_loop *loop);
 void og_schedule_refresh(struct ev_loop *loop);
-void og_schedule_run(unsigned int task_id, unsigned int schedule_id,
-		     enum og_schedule_type type);
+void og_schedule_run(const struct og_schedule_task *tasks, unsigned int len);
 
 int og_dbi_schedule_get(void);
 int og_dbi_update_action(uint32_t id, bool success);
@@ -58,6 +67,7 @@ struct og_task {
 	uint32_t	scope;
 	const char	*filtered_scope;
 	const char	*params;
+	struct list_head *cmd_list;
 };
 
 int og_dbi_queue_procedure(struct og_dbi *dbi, struct og_task *task);
@@ -0,0 +1,353 @@
+/*
+ * Copyright (C) 2020 Soleta Networks <info@soleta.eu>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, version 3.
+ */
+
+#include "scope.h"
+#include "utils.h"
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+struct og_scope_tree og_scope_tree = {
+	.center_list	= LIST_HEAD_INIT(og_scope_tree.center_list),
+	.group_list	= LIST_HEAD_INIT(og_scope_tree.group_list),
+};
+
+static void og_scope_free(struct list_head *center_list)
+{
+	struct og_scope_computer *computer, *next_computer;
+	struct og_scope_center *center, *next_center;
+	struct og_scope_room *room, *next_room;
+
+	list_for_each_entry_safe(center, next_center, center_list, list) {
+		list_for_each_entry_safe(room, next_room, &center->room_list, list) {
+			list_for_each_entry_safe(computer, next_computer,
+						 &room->computer_list, list) {
+				list_del(&computer->list);
+				free(computer);
+			}
+			list_del(&room->list);
+			free(room);
+		}
+		list_del(&center->list);
+		free(center);
+	}
+}
+
+static void og_scope_groups_free(struct list_head *group_list)
+{
+	struct og_scope_group *group, *next;
+
+	list_for_each_entry_safe(group, next, group_list, list) {
+		list_del(&group->list);
+		free(group);
+	}
+}
+
+static struct og_scope_center *og_scope_center_find(struct list_head *center_list,
+						    uint32_t center_id)
+{
+	struct og_scope_center *center;
+
+	list_for_each_entry(center, center_list, list) {
+		if (center->id == center_id)
+			return center;
+	}
+
+	return NULL;
+}
+
+static struct og_scope_room *og_scope_room_find(struct list_head *center_list,
+						uint32_t room_id)
+{
+	struct og_scope_center *center;
+	struct og_scope_room *room;
+
+	list_for_each_entry(center, center_list, list) {
+		list_for_each_entry(room, &center->room_list, list) {
+			if (room->id == room_id)
+				return room;
+		}
+	}
+
+	return NULL;
+}
+
+static struct og_scope_group *og_scope_group_find(struct list_head *group_list,
+						  uint32_t group_id)
+{
+	struct og_scope_group *group;
+
+	list_for_each_entry(group, group_list, list) {
+		if (group->id == group_id)
+			return group;
+	}
+
+	return NULL;
+}
+
+static int og_dbi_scope_load_groups(struct og_dbi *dbi,
+				    struct list_head *group_list,
+				    uint32_t *hash)
+{
+	struct og_scope_group *group;
+	const char *msglog;
+	dbi_result result;
+
+	result = dbi_conn_queryf(dbi->conn,
+				 "SELECT idgrupo, grupoid FROM gruposordenadores");
+	if (!result) {
+		dbi_conn_error(dbi->conn, &msglog);
+		syslog(LOG_ERR, "failed to query database (%s:%d) %s\n",
+		       __func__, __LINE__, msglog);
+		return -1;
+	}
+
+	while (dbi_result_next_row(result)) {
+		group = calloc(1, sizeof(struct og_scope_group));
+		if (!group) {
+			dbi_result_free(result);
+			return -1;
+		}
+		INIT_LIST_HEAD(&group->computer_list);
+		group->id = dbi_result_get_uint(result, "idgrupo");
+		group->parent_id = dbi_result_get_uint(result, "grupoid");
+		list_add_tail(&group->list, group_list);
+
+		*hash = og_hash_update(*hash, &group->id, sizeof(group->id));
+		*hash = og_hash_update(*hash, &group->parent_id,
+				       sizeof(group->parent_id));
+	}
+	dbi_result_free(result);
+
+	return 0;
+}
+
+static int og_dbi_scope_load_centers(struct og_dbi *dbi,
+				     struct list_head *center_list,
+				     uint32_t *hash)
+{
+	struct og_scope_center *center;
+	const char *msglog;
+	dbi_result result;
+
+	result = dbi_conn_queryf(dbi->conn,
+				 "SELECT nombrecentro, idcentro FROM centros");
+	if (!result) {
+		dbi_conn_error(dbi->conn, &msglog);
+		syslog(LOG_ERR, "failed to query database (%s:%d) %s\n",
+		       __func__, __LINE__, msglog);
+		return -1;
+	}
+
+	while (dbi_result_next_row(result)) {
+		center = calloc(1, sizeof(struct og_scope_center));
+		if (!center) {
+			dbi_result_free(result);
+			return -1;
+		}
+		INIT_LIST_HEAD(&center->room_list);
+		center->id = dbi_result_get_uint(result, "idcentro");
+		strncpy(center->name,
+			dbi_result_get_string(result, "nombrecentro"),
+			OG_DB_CENTER_NAME_MAXLEN);
+		list_add_tail(&center->list, center_list);
+
+		*hash = og_hash_update(*hash, &center->id, sizeof(center->id));
+		*hash = og_hash_update(*hash, center->name, strlen(center->name));
+	}
+	dbi_result_free(result);
+
+	return 0;
+}
+
+static int og_dbi_scope_load_rooms(struct og_dbi *dbi,
+				   struct list_head *center_list,
+				   uint32_t *hash)
+{
+	struct og_scope_center *center = NULL;
+	struct og_scope_room *room;
+	const char *msglog;
+	dbi_result result;
+	uint32_t center_id;
+
+	result = dbi_conn_queryf(dbi->conn,
+				 "SELECT idaula, nombreaula, idcentro FROM aulas "
+				 "ORDER BY idcentro, idaula");
+	if (!result) {
+		dbi_conn_error(dbi->conn, &msglog);
+		syslog(LOG_ERR, "failed to query database (%s:%d) %s\n",
+		       __func__, __LINE__, msglog);
+		return -1;
+	}
+
+	while (dbi_result_next_row(result)) {
+		center_id = dbi_result_get_uint(result, "idcentro");
+		if (!center || center->id != center_id)
+			center = og_scope_center_find(center_list, center_id);
+		if (!center)
+			continue;
+
+		room = calloc(1, sizeof(struct og_scope_room));
+		if (!room) {
+			dbi_result_free(result);
+			return -1;
+		}
+		INIT_LIST_HEAD(&room->computer_list);
+		room->id = dbi_result_get_uint(result, "idaula");
+		room->center_id = center_id;
+		strncpy(room->name,
+			dbi_result_get_string(result, "nombreaula"),
+			OG_DB_ROOM_NAME_MAXLEN);
+		list_add_tail(&room->list, &center->room_list);
+
+		*hash = og_hash_update(*hash, &room->id, sizeof(room->id));
+		*hash = og_hash_update(*hash, &center_id, sizeof(center_id));
+		*hash = og_hash_update(*hash, room->name, strlen(room->name));
+	}
+	dbi_result_free(result);
+
+	return 0;
+}
+
+static int og_dbi_scope_load_computers(struct og_dbi *dbi,
+				       struct list_head *center_list,
+				       struct list_head *group_list,
+				       uint32_t *hash)
+{
+	struct og_scope_group *group = NULL;
+	struct og_scope_room *room = NULL;
+	struct og_scope_computer *computer;
+	uint32_t room_id, group_id;
+	const char *msglog;
+	dbi_result result;
+
+	result = dbi_conn_queryf(dbi->conn,
+				 "SELECT idordenador, nombreordenador, ip, idaula, "
+				 "grupoid FROM ordenadores ORDER BY idaula, idordenador");
+	if (!result) {
+		dbi_conn_error(dbi->conn, &msglog);
+		syslog(LOG_ERR, "failed to query database (%s:%d) %s\n",
+		       __func__, __LINE__, msglog);
+		return -1;
+	}
+
+	while (dbi_result_next_row(result)) {
+		room_id = dbi_result_get_uint(result, "idaula");
+		if (!room || room->id != room_id)
+			room = og_scope_room_find(center_list, room_id);
+		if (!room)
+			continue;
+
+		computer = calloc(1, sizeof(struct og_scope_computer));
+		if (!computer) {
+			dbi_result_free(result);
+			return -1;
+		}
+		computer->id = dbi_result_get_uint(result, "idordenador");
+		strncpy(computer->name,
+			dbi_result_get_string(result, "nombreordenador"),
+			OG_DB_COMPUTER_NAME_MAXLEN);
+		inet_aton(dbi_result_get_string(result, "ip"), &computer->addr);
+		inet_ntop(AF_INET, &computer->addr, computer->ip,
+			  sizeof(computer->ip));
+		list_add_tail(&computer->list, &room->computer_list);
+
+		group_id = dbi_result_get_uint(result, "grupoid");
+		if (group_id && (!group || group->id != group_id))
+			group = og_scope_group_find(group_list, group_id);
+		if (group_id && group)
+			list_add_tail(&computer->group_list,
+				      &group->computer_list);
+		else
+			INIT_LIST_HEAD(&computer->group_list);
+
+		*hash = og_hash_update(*hash, &computer->id, sizeof(computer->id));
+		*hash = og_hash_update(*hash, &room_id, sizeof(room_id));
+		*hash = og_hash_update(*hash, &group_id, sizeof(group_id));
+		*hash = og_hash_update(*hash, &computer->addr,
+				       sizeof(computer->addr));
+		*hash = og_hash_update(*hash, computer->name,
+				       strlen(computer->name));
+	}
+	dbi_result_free(result);
+
+	return 0;
+}
+
+struct og_scope_center *og_scope_center_lookup(uint32_t center_id)
+{
+	return og_scope_center_find(&og_scope_tree.center_list, center_id);
+}
+
+struct og_scope_room *og_scope_room_lookup(uint32_t room_id)
+{
+	return og_scope_room_find(&og_scope_tree.center_list, room_id);
+}
+
+struct og_scope_group *og_scope_group_lookup(uint32_t group_id)
+{
+	return og_scope_group_find(&og_scope_tree.group_list, group_id);
+}
+
+/* Reload the scope tree from the database once the cached copy expires, the
+ * version is bumped only if the tree has changed since the last reload.
+ */
+int og_scope_refresh(void)
+{
+	struct list_head center_list, group_list;
+	uint32_t hash = OG_HASH_INIT;
+	struct og_dbi *dbi;
+	time_t now;
+
+	now = time(NULL);
+	if (og_scope_tree.users)
+		return 0;
+
+	if (og_scope_tree.last_update &&
+	    now - og_scope_tree.last_update < OG_SCOPE_CACHE_TTL)
+		return 0;
+
+	dbi = og_dbi_open(&dbi_config);
+	if (!dbi) {
+		syslog(LOG_ERR, "cannot open connection database (%s:%d)\n",
+		       __func__, __LINE__);
+		return -1;
+	}
+
+	INIT_LIST_HEAD(&center_list);
+	INIT_LIST_HEAD(&group_list);
+	if (og_dbi_scope_load_centers(dbi, &center_list, &hash) < 0 ||
+	    og_dbi_scope_load_rooms(dbi, &center_list, &hash) < 0 ||
+	    og_dbi_scope_load_groups(dbi, &group_list, &hash) < 0 ||
+	    og_dbi_scope_load_computers(dbi, &center_list, &group_list,
+					&hash) < 0) {
+		og_dbi_close(dbi);
+		og_scope_free(&center_list);
+		og_scope_groups_free(&group_list);
+		return -1;
+	}
+	og_dbi_close(dbi);
+
+	og_scope_tree.last_update = now;
+
+	if (og_scope_tree.version && og_scope_tree.hash == hash) {
+		og_scope_free(&center_list);
+		og_scope_groups_free(&group_list);
+		return 0;
+	}
+
+	og_scope_free(&og_scope_tree.center_list);
+	og_scope_groups_free(&og_scope_tree.group_list);
+	list_splice_init(&center_list, &og_scope_tree.center_list);
+	list_splice_init(&group_list, &og_scope_tree.group_list);
+	og_scope_tree.hash = hash;
+	og_scope_tree.version++;
+
+	return 0;
+}
@@ -0,0 +1,65 @@
+#ifndef _OG_SCOPE_H
+#define _OG_SCOPE_H
+
+#include <stdint.h>
+#include <time.h>
+#include <netinet/in.h>
+#include "dbi.h"
+#include "list.h"
+
+struct og_scope_computer {
+	struct list_head	list;
+	struct list_head	group_list;
+	uint32_t		id;
+	char			name[OG_DB_COMPUTER_NAME_MAXLEN + 1];
+	struct in_addr		addr;
+	char			ip[INET_ADDRSTRLEN];
+};
+
+struct og_scope_room {
+	struct list_head	list;
+	uint32_t		id;
+	uint32_t		center_id;
+	char			name[OG_DB_ROOM_NAME_MAXLEN + 1];
+	struct list_head	computer_list;
+};
+
+struct og_scope_center {
+	struct list_head	list;
+	uint32_t		id;
+	char			name[OG_DB_CENTER_NAME_MAXLEN + 1];
+	struct list_head	room_list;
+};
+
+/* Computer groups nest, the computers of a group are linked through their
+ * group_list.
+ */
+struct og_scope_group {
+	struct list_head	list;
+	uint32_t		id;
+	uint32_t		parent_id;
+	struct list_head	computer_list;
+};
+
+struct og_scope_tree {
+	struct list_head	center_list;
+	struct list_head	group_list;
+	uint32_t		version;
+	uint32_t		hash;
+	time_t			last_update;
+	unsigned int		users;
+};
+
+/* Scopes are edited from the web console, reload them every 30 seconds. The
+ * tree is not reloaded while a reply is still being streamed from it.
+ */
+#define OG_SCOPE_CACHE_TTL	30
+
+extern struct og_scope_tree og_scope_tree;
+
+int og_scope_refresh(void);
+struct og_scope_center *og_scope_center_lookup(uint32_t center_id);
+struct og_scope_room *og_scope_room_lookup(uint32_t room_id);
+struct og_scope_group *og_scope_group_lookup(uint32_t group_id);
+
+#endif
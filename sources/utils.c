@@ -7,6 +7,8 @@
  */
 
 #include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
 #include "utils.h"
 
 const char *str_toupper(char *str)
@@ -20,3 +22,75 @@ const char *str_toupper(char *str)
 
        return str;
 }
+
+/* FNV-1a, use OG_HASH_INIT as initial hash. */
+uint32_t og_hash_update(uint32_t hash, const void *data, size_t len)
+{
+	const uint8_t *ptr = data;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= ptr[i];
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+#define OG_ARENA_CHUNK_SIZE	8192
+
+struct og_arena_chunk {
+	struct og_arena_chunk	*next;
+	size_t			size;
+	size_t			used;
+	char			data[];
+};
+
+void *og_arena_alloc(struct og_arena *arena, size_t size)
+{
+	struct og_arena_chunk *chunk = arena->chunk;
+	size_t chunk_size;
+	void *ptr;
+
+	size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+	if (!chunk || chunk->size - chunk->used < size) {
+		chunk_size = size > OG_ARENA_CHUNK_SIZE ? size : OG_ARENA_CHUNK_SIZE;
+
+		chunk = malloc(sizeof(*chunk) + chunk_size);
+		if (!chunk)
+			return NULL;
+
+		chunk->size = chunk_size;
+		chunk->used = 0;
+		chunk->next = arena->chunk;
+		arena->chunk = chunk;
+	}
+
+	ptr = chunk->data + chunk->used;
+	chunk->used += size;
+
+	return ptr;
+}
+
+void *og_arena_zalloc(struct og_arena *arena, size_t size)
+{
+	void *ptr;
+
+	ptr = og_arena_alloc(arena, size);
+	if (ptr)
+		memset(ptr, 0, size);
+
+	return ptr;
+}
+
+void og_arena_free(struct og_arena *arena)
+{
+	struct og_arena_chunk *chunk, *next;
+
+	for (chunk = arena->chunk; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+	arena->chunk = NULL;
+}
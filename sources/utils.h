@@ -1,6 +1,31 @@
 #ifndef _OG_UTILS_H
 #define _OG_UTILS_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 const char *str_toupper(char *str);
 
+#define OG_HASH_INIT	2166136261U
+
+uint32_t og_hash_update(uint32_t hash, const void *data, size_t len);
+
+static inline uint32_t og_hash(const void *data, size_t len)
+{
+	return og_hash_update(OG_HASH_INIT, data, len);
+}
+
+struct og_arena_chunk;
+
+/* Bump allocator for per-request scratch memory, everything that is allocated
+ * from the arena is released at once through og_arena_free().
+ */
+struct og_arena {
+	struct og_arena_chunk	*chunk;
+};
+
+void *og_arena_alloc(struct og_arena *arena, size_t size);
+void *og_arena_zalloc(struct og_arena *arena, size_t size);
+void og_arena_free(struct og_arena *arena);
+
 #endif
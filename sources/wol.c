@@ -0,0 +1,507 @@
+/*
+ * Copyright (C) 2020 Soleta Networks <info@soleta.eu>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, version 3.
+ */
+
+#define _GNU_SOURCE
+#include "ogAdmServer.h"
+#include "schedule.h"
+#include "utils.h"
+#include "list.h"
+#include "wol.h"
+#include <syslog.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#define OG_WOL_SEQUENCE		6
+#define OG_WOL_REPEAT		16
+#define OG_WOL_BATCH		64
+
+struct wol_msg {
+	char secuencia_FF[OG_WOL_SEQUENCE];
+	char macbin[OG_WOL_REPEAT][OG_WOL_MACADDR_LEN];
+};
+
+struct og_wol_config og_wol_config = {
+	.wave_size	= 64,
+	.wave_interval	= 1.,
+	.timeout	= 180.,
+	.retries	= 2,
+};
+
+enum og_wol_state {
+	OG_WOL_QUEUED,
+	OG_WOL_SENT,
+	OG_WOL_AWAKE,
+	OG_WOL_FAILED,
+};
+
+static const char *og_wol_state_str[] = {
+	[OG_WOL_QUEUED]	= "queued",
+	[OG_WOL_SENT]	= "sent",
+	[OG_WOL_AWAKE]	= "awake",
+	[OG_WOL_FAILED]	= "failed",
+};
+
+struct og_wol_entry {
+	struct list_head	hash_list;
+	struct list_head	list;
+	struct og_wol_target	target;
+	enum og_wol_state	state;
+	unsigned int		attempts;
+	uint32_t		action_id;
+	ev_tstamp		deadline;
+};
+
+#define OG_WOL_HASH_SIZE	1024
+
+/* Targets that are awake or failed are still reported for a while. */
+#define OG_WOL_RETENTION	600.
+
+static struct {
+	int			sd;
+	char			interface[IFNAMSIZ];
+	struct in_addr		broadcast;
+	struct ev_io		netlink_io;
+	struct ev_loop		*loop;
+	struct ev_timer		wave_timer;
+	struct list_head	queue_list;
+	struct list_head	sent_list;
+	struct list_head	done_list;
+	struct list_head	hash[OG_WOL_HASH_SIZE];
+	struct og_wol_target	*wave;
+} og_wol = {
+	.sd		= -1,
+};
+
+/* Resolves the broadcast address of the configured interface, this is only
+ * done on startup and whenever the kernel reports an address change.
+ */
+static void og_wol_broadcast_refresh(void)
+{
+	struct sockaddr_in *broadcast_addr;
+	struct ifaddrs *ifaddr, *ifa;
+
+	og_wol.broadcast.s_addr = htonl(INADDR_BROADCAST);
+
+	if (getifaddrs(&ifaddr) < 0) {
+		syslog(LOG_ERR, "cannot get list of addresses\n");
+		return;
+	}
+
+	for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
+		if (ifa->ifa_addr == NULL ||
+		    ifa->ifa_addr->sa_family != AF_INET ||
+		    !ifa->ifa_ifu.ifu_broadaddr ||
+		    strcmp(ifa->ifa_name, og_wol.interface) != 0)
+			continue;
+
+		broadcast_addr =
+			(struct sockaddr_in *)ifa->ifa_ifu.ifu_broadaddr;
+		og_wol.broadcast.s_addr = broadcast_addr->sin_addr.s_addr;
+		break;
+	}
+	freeifaddrs(ifaddr);
+}
+
+static void og_wol_netlink_cb(struct ev_loop *loop, struct ev_io *io,
+			      int events)
+{
+	char buf[4096];
+	bool changed = false;
+
+	while (recv(io->fd, buf, sizeof(buf), 0) > 0)
+		changed = true;
+
+	if (changed)
+		og_wol_broadcast_refresh();
+}
+
+static int og_wol_netlink_init(struct ev_loop *loop)
+{
+	struct sockaddr_nl addr = {
+		.nl_family	= AF_NETLINK,
+		.nl_groups	= RTMGRP_LINK | RTMGRP_IPV4_IFADDR,
+	};
+	int sd;
+
+	sd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		    NETLINK_ROUTE);
+	if (sd < 0)
+		return -1;
+
+	if (bind(sd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(sd);
+		return -1;
+	}
+
+	ev_io_init(&og_wol.netlink_io, og_wol_netlink_cb, sd, EV_READ);
+	ev_io_start(loop, &og_wol.netlink_io);
+
+	return 0;
+}
+
+static void og_wol_wave_cb(struct ev_loop *loop, struct ev_timer *timer,
+			   int events);
+
+int og_wol_init(struct ev_loop *loop, const char *interface)
+{
+	unsigned int on = 1;
+	int i;
+
+	og_wol.wave = calloc(og_wol_config.wave_size,
+			     sizeof(struct og_wol_target));
+	if (!og_wol.wave)
+		return -1;
+
+	og_wol.loop = loop;
+	INIT_LIST_HEAD(&og_wol.queue_list);
+	INIT_LIST_HEAD(&og_wol.sent_list);
+	INIT_LIST_HEAD(&og_wol.done_list);
+	for (i = 0; i < OG_WOL_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&og_wol.hash[i]);
+	ev_timer_init(&og_wol.wave_timer, og_wol_wave_cb, 0.,
+		      og_wol_config.wave_interval);
+
+	og_wol.sd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			   IPPROTO_UDP);
+	if (og_wol.sd < 0) {
+		syslog(LOG_ERR, "cannot create socket for magic packet\n");
+		return -1;
+	}
+
+	if (setsockopt(og_wol.sd, SOL_SOCKET, SO_BROADCAST, &on,
+		       sizeof(on)) < 0) {
+		syslog(LOG_ERR, "cannot set broadcast socket\n");
+		close(og_wol.sd);
+		og_wol.sd = -1;
+		return -1;
+	}
+
+	snprintf(og_wol.interface, sizeof(og_wol.interface), "%s", interface);
+	og_wol_broadcast_refresh();
+
+	if (og_wol_netlink_init(loop) < 0)
+		syslog(LOG_ERR, "cannot track address changes, broadcast address for %s will not be refreshed\n",
+		       og_wol.interface);
+
+	return 0;
+}
+
+int og_wol_target_init(struct og_wol_target *target, const char *ip,
+		       const char *mac, enum og_wol_type type)
+{
+	/* The client address is also used to track when its agent connects. */
+	if (!inet_aton(ip, &target->addr))
+		target->addr.s_addr = htonl(INADDR_ANY);
+
+	target->type = type;
+	switch (target->type) {
+	case OG_WOL_BROADCAST:
+		break;
+	case OG_WOL_UNICAST:
+		if (target->addr.s_addr == htonl(INADDR_ANY)) {
+			syslog(LOG_ERR, "bad IP address for unicast wol\n");
+			return -1;
+		}
+		break;
+	default:
+		syslog(LOG_ERR, "unknown wol type\n");
+		return -1;
+	}
+
+	if (sscanf(mac, "%02hhx%02hhx%02hhx%02hhx%02hhx%02hhx",
+		   &target->mac[0], &target->mac[1], &target->mac[2],
+		   &target->mac[3], &target->mac[4], &target->mac[5]) != 6) {
+		syslog(LOG_ERR, "bad MAC address %s for wol\n", mac);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Sends one magic packet per target, in batches. Returns the number of
+ * packets that have been sent. If the target after those cannot be sent,
+ * error is set, it is zero if the socket is just full.
+ */
+static int og_wol_send(const struct og_wol_target *targets, unsigned int len,
+		       int *error)
+{
+	struct sockaddr_in addrs[OG_WOL_BATCH];
+	struct mmsghdr hdrs[OG_WOL_BATCH];
+	struct wol_msg msgs[OG_WOL_BATCH];
+	struct iovec iovs[OG_WOL_BATCH];
+	unsigned int i, j, n, sent = 0;
+	int ret;
+
+	*error = 0;
+	if (og_wol.sd < 0) {
+		*error = EBADF;
+		return 0;
+	}
+
+	while (sent < len) {
+		n = len - sent;
+		if (n > OG_WOL_BATCH)
+			n = OG_WOL_BATCH;
+
+		memset(hdrs, 0, n * sizeof(struct mmsghdr));
+		for (i = 0; i < n; i++) {
+			const struct og_wol_target *target = &targets[sent + i];
+
+			memset(msgs[i].secuencia_FF, 0xff, OG_WOL_SEQUENCE);
+			for (j = 0; j < OG_WOL_REPEAT; j++)
+				memcpy(msgs[i].macbin[j], target->mac,
+				       OG_WOL_MACADDR_LEN);
+
+			memset(&addrs[i], 0, sizeof(struct sockaddr_in));
+			addrs[i].sin_family = AF_INET;
+			addrs[i].sin_port = htons(PUERTO_WAKEUP);
+			if (target->type == OG_WOL_BROADCAST)
+				addrs[i].sin_addr = og_wol.broadcast;
+			else
+				addrs[i].sin_addr = target->addr;
+
+			iovs[i].iov_base = &msgs[i];
+			iovs[i].iov_len = sizeof(struct wol_msg);
+			hdrs[i].msg_hdr.msg_name = &addrs[i];
+			hdrs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+			hdrs[i].msg_hdr.msg_iov = &iovs[i];
+			hdrs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		ret = sendmmsg(og_wol.sd, hdrs, n, 0);
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				syslog(LOG_ERR, "wol socket is full, %u packets not sent\n",
+				       len - sent);
+				break;
+			}
+			*error = errno;
+			syslog(LOG_ERR, "failed to send wol (%s)\n",
+			       strerror(*error));
+			break;
+		}
+		sent += ret;
+	}
+
+	return sent;
+}
+
+static struct list_head *og_wol_hash_bucket(struct in_addr addr)
+{
+	return &og_wol.hash[og_hash(&addr, sizeof(addr)) % OG_WOL_HASH_SIZE];
+}
+
+static struct og_wol_entry *og_wol_lookup(struct in_addr addr)
+{
+	struct og_wol_entry *entry;
+
+	list_for_each_entry(entry, og_wol_hash_bucket(addr), hash_list) {
+		if (entry->target.addr.s_addr == addr.s_addr)
+			return entry;
+	}
+
+	return NULL;
+}
+
+/* The deadline of a target that is done is the end of its retention. */
+static void og_wol_done(struct og_wol_entry *entry, enum og_wol_state state)
+{
+	list_del(&entry->list);
+	list_add_tail(&entry->list, &og_wol.done_list);
+	entry->state = state;
+	entry->deadline = ev_now(og_wol.loop) + OG_WOL_RETENTION;
+
+	if (entry->action_id) {
+		og_dbi_update_action(entry->action_id, state == OG_WOL_AWAKE);
+		entry->action_id = 0;
+	}
+}
+
+static void og_wol_expire(ev_tstamp now)
+{
+	struct og_wol_entry *entry, *next;
+
+	list_for_each_entry_safe(entry, next, &og_wol.done_list, list) {
+		if (entry->deadline > now)
+			break;
+
+		list_del(&entry->list);
+		list_del(&entry->hash_list);
+		free(entry);
+	}
+}
+
+/* Sends the next wave of magic packets. Targets whose agent has not connected
+ * by their deadline are queued again, until they run out of retries.
+ */
+static void og_wol_wave_cb(struct ev_loop *loop, struct ev_timer *timer,
+			   int events)
+{
+	struct og_wol_entry *entry, *next;
+	ev_tstamp now = ev_now(loop);
+	unsigned int i, len = 0;
+	int sent, error;
+
+	og_wol_expire(now);
+
+	list_for_each_entry_safe(entry, next, &og_wol.sent_list, list) {
+		if (entry->deadline > now)
+			break;
+
+		if (entry->attempts > og_wol_config.retries) {
+			syslog(LOG_INFO, "client %s did not wake up\n",
+			       inet_ntoa(entry->target.addr));
+			og_wol_done(entry, OG_WOL_FAILED);
+			continue;
+		}
+		list_del(&entry->list);
+		list_add_tail(&entry->list, &og_wol.queue_list);
+		entry->state = OG_WOL_QUEUED;
+	}
+
+	list_for_each_entry(entry, &og_wol.queue_list, list) {
+		if (len == og_wol_config.wave_size)
+			break;
+
+		og_wol.wave[len++] = entry->target;
+	}
+
+	sent = og_wol_send(og_wol.wave, len, &error);
+	for (i = 0; (int)i < sent; i++) {
+		entry = list_first_entry(&og_wol.queue_list,
+					 struct og_wol_entry, list);
+		list_del(&entry->list);
+		list_add_tail(&entry->list, &og_wol.sent_list);
+		entry->state = OG_WOL_SENT;
+		entry->attempts++;
+		entry->deadline = now + og_wol_config.timeout;
+	}
+
+	/* The target that cannot be sent fails, so it does not hold back those
+	 * queued after it. Without a socket, nothing can be sent at all.
+	 */
+	list_for_each_entry_safe(entry, next, &og_wol.queue_list, list) {
+		if (!error)
+			break;
+
+		syslog(LOG_ERR, "cannot wake up client %s (%s)\n",
+		       inet_ntoa(entry->target.addr), strerror(error));
+		og_wol_done(entry, OG_WOL_FAILED);
+
+		if (og_wol.sd >= 0)
+			break;
+	}
+
+	if (list_empty(&og_wol.queue_list) && list_empty(&og_wol.sent_list))
+		ev_timer_stop(loop, timer);
+}
+
+/* Queues this target for the next wave. The action, if any, is updated once
+ * the agent connects or the target runs out of retries.
+ */
+int og_wol_wake(const struct og_wol_target *target, uint32_t action_id)
+{
+	struct og_wol_entry *entry;
+	int error;
+
+	/* No address to track this target, just send it once. */
+	if (target->addr.s_addr == htonl(INADDR_ANY)) {
+		if (og_wol_send(target, 1, &error) != 1)
+			return -1;
+		if (action_id)
+			og_dbi_update_action(action_id, true);
+		return 0;
+	}
+
+	og_wol_expire(ev_now(og_wol.loop));
+
+	entry = og_wol_lookup(target->addr);
+	if (!entry) {
+		entry = calloc(1, sizeof(struct og_wol_entry));
+		if (!entry)
+			return -1;
+
+		INIT_LIST_HEAD(&entry->list);
+		entry->state = OG_WOL_AWAKE;
+		list_add_tail(&entry->hash_list,
+			      og_wol_hash_bucket(target->addr));
+	}
+
+	/* A newer request supersedes the action that is still in progress,
+	 * which is finished as failed since its client has not woken up yet.
+	 */
+	if (action_id && entry->action_id)
+		og_dbi_update_action(entry->action_id, false);
+	if (action_id)
+		entry->action_id = action_id;
+
+	entry->target = *target;
+	if (entry->state == OG_WOL_AWAKE || entry->state == OG_WOL_FAILED) {
+		entry->state = OG_WOL_QUEUED;
+		entry->attempts = 0;
+		list_del(&entry->list);
+		list_add_tail(&entry->list, &og_wol.queue_list);
+	}
+
+	if (!ev_is_active(&og_wol.wave_timer))
+		ev_timer_start(og_wol.loop, &og_wol.wave_timer);
+
+	return 0;
+}
+
+/* The agent running at this address has connected. */
+void og_wol_awake(struct in_addr addr)
+{
+	struct og_wol_entry *entry;
+
+	entry = og_wol_lookup(addr);
+	if (!entry ||
+	    (entry->state != OG_WOL_QUEUED && entry->state != OG_WOL_SENT))
+		return;
+
+	og_wol_done(entry, OG_WOL_AWAKE);
+}
+
+json_t *og_wol_status(void)
+{
+	unsigned int count[OG_WOL_FAILED + 1] = {};
+	struct og_wol_entry *entry;
+	json_t *root, *array;
+	int i;
+
+	og_wol_expire(ev_now(og_wol.loop));
+
+	array = json_array();
+	if (!array)
+		return NULL;
+
+	for (i = 0; i < OG_WOL_HASH_SIZE; i++) {
+		list_for_each_entry(entry, &og_wol.hash[i], hash_list) {
+			count[entry->state]++;
+			json_array_append_new(array,
+				json_pack("{s:s, s:s, s:i}",
+					  "addr", inet_ntoa(entry->target.addr),
+					  "state", og_wol_state_str[entry->state],
+					  "attempts", entry->attempts));
+		}
+	}
+
+	root = json_pack("{s:i, s:i, s:i, s:i, s:o}",
+			 "queued", count[OG_WOL_QUEUED],
+			 "sent", count[OG_WOL_SENT],
+			 "awake", count[OG_WOL_AWAKE],
+			 "failed", count[OG_WOL_FAILED],
+			 "clients", array);
+	if (!root)
+		json_decref(array);
+
+	return root;
+}
@@ -0,0 +1,39 @@
+#ifndef _OG_WOL_H
+#define _OG_WOL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <netinet/in.h>
+#include <ev.h>
+#include <jansson.h>
+
+#define OG_WOL_MACADDR_LEN	6
+
+enum og_wol_type {
+	OG_WOL_BROADCAST = 1,
+	OG_WOL_UNICAST = 2
+};
+
+struct og_wol_target {
+	struct in_addr		addr;
+	uint8_t			mac[OG_WOL_MACADDR_LEN];
+	enum og_wol_type	type;
+};
+
+struct og_wol_config {
+	unsigned int	wave_size;
+	ev_tstamp	wave_interval;
+	ev_tstamp	timeout;
+	unsigned int	retries;
+};
+
+extern struct og_wol_config og_wol_config;
+
+int og_wol_init(struct ev_loop *loop, const char *interface);
+int og_wol_target_init(struct og_wol_target *target, const char *ip,
+		       const char *mac, enum og_wol_type type);
+int og_wol_wake(const struct og_wol_target *target, uint32_t action_id);
+void og_wol_awake(struct in_addr addr);
+json_t *og_wol_status(void);
+
+#endif
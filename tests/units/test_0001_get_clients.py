@@ -11,6 +11,33 @@ class TestGetClientsMethods(unittest.TestCase):
         returned = requests.get(self.url, headers=self.headers)
         self.assertEqual(returned.status_code, 200)
 
+    def test_get_since(self):
+        returned = requests.get(self.url + '?since=0', headers=self.headers)
+        self.assertEqual(returned.status_code, 200)
+        self.assertTrue(returned.json()['full'])
+        seq = returned.json()['seq']
+        returned = requests.get(self.url + '?since=' + str(seq),
+                                headers=self.headers)
+        self.assertEqual(returned.status_code, 200)
+        self.assertEqual(returned.json()['seq'], seq)
+
+    def test_get_since_invalid(self):
+        returned = requests.get(self.url + '?since=abc', headers=self.headers)
+        self.assertEqual(returned.status_code, 400)
+
+    def test_get_filter(self):
+        returned = requests.get(self.url + '?state=BSY&limit=10',
+                                headers=self.headers)
+        self.assertEqual(returned.status_code, 200)
+        self.assertIn('clients', returned.json())
+
+    def test_get_filter_invalid(self):
+        returned = requests.get(self.url + '?from=1.2.3', headers=self.headers)
+        self.assertEqual(returned.status_code, 400)
+        returned = requests.get(self.url + '?since=0&state=BSY',
+                                headers=self.headers)
+        self.assertEqual(returned.status_code, 400)
+
     def test_post_without_data(self):
         returned = requests.post(self.url, headers=self.headers)
         self.assertEqual(returned.status_code, 400)
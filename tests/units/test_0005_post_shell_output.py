@@ -12,6 +12,12 @@ class TestPostShellOutputMethods(unittest.TestCase):
         returned = requests.post(self.url, headers=self.headers, json=self.json)
         self.assertEqual(returned.status_code, 200)
 
+    def test_post_no_output(self):
+        returned = requests.post(self.url, headers=self.headers, json=self.json)
+        self.assertEqual(returned.status_code, 200)
+        for client in returned.json()['clients']:
+            self.assertEqual(client['output'], '')
+
     def test_no_payload(self):
         returned = requests.post(self.url, headers=self.headers, json=None)
         self.assertEqual(returned.status_code, 400)
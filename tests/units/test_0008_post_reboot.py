@@ -20,6 +20,12 @@ class TestPostRebootMethods(unittest.TestCase):
         returned = requests.post(self.url, headers=self.headers, json={})
         self.assertEqual(returned.status_code, 400)
 
+    def test_malformed_scope(self):
+        returned = requests.post(self.url, headers=self.headers,
+                                 json={'scope' : {'type' : 'building',
+                                                  'id' : 1}})
+        self.assertEqual(returned.status_code, 400)
+
     def test_get(self):
         returned = requests.get(self.url, headers=self.headers)
         self.assertEqual(returned.status_code, 405)
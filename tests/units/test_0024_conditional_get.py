@@ -0,0 +1,33 @@
+import requests
+import unittest
+
+class TestConditionalGetMethods(unittest.TestCase):
+
+    def setUp(self):
+        self.url = 'http://localhost:8888/'
+        self.headers = {'Authorization' : '07b3bfe728954619b58f0107ad73acc1'}
+
+    def conditional_get(self, cmd):
+        returned = requests.get(self.url + cmd, headers=self.headers)
+        self.assertEqual(returned.status_code, 200)
+        self.assertTrue('ETag' in returned.headers)
+
+        headers = dict(self.headers)
+        headers['If-None-Match'] = returned.headers['ETag']
+        returned = requests.get(self.url + cmd, headers=headers)
+        self.assertEqual(returned.status_code, 304)
+
+    def test_get_clients(self):
+        self.conditional_get('clients')
+
+    def test_get_scopes(self):
+        self.conditional_get('scopes')
+
+    def test_get_clients_wrong_etag(self):
+        headers = dict(self.headers)
+        headers['If-None-Match'] = '"wrong"'
+        returned = requests.get(self.url + 'clients', headers=headers)
+        self.assertEqual(returned.status_code, 200)
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,33 @@
+import requests
+import unittest
+
+class TestGetWolStatusMethods(unittest.TestCase):
+
+    def setUp(self):
+        self.url = 'http://localhost:8888/wol/status'
+        self.wol_url = 'http://localhost:8888/wol'
+        self.headers = {'Authorization' : '07b3bfe728954619b58f0107ad73acc1'}
+        self.json = { 'type' : 'unicast', 'clients' : [ { 'addr' : '192.168.2.2',
+            'mac' : '00AABBCCDD02' } ] }
+
+    def test_get(self):
+        returned = requests.get(self.url, headers=self.headers)
+        self.assertEqual(returned.status_code, 200)
+        for key in ['queued', 'sent', 'awake', 'failed', 'clients']:
+            self.assertIn(key, returned.json())
+
+    def test_get_after_wol(self):
+        returned = requests.post(self.wol_url, headers=self.headers,
+                                 json=self.json)
+        self.assertEqual(returned.status_code, 200)
+        returned = requests.get(self.url, headers=self.headers)
+        self.assertEqual(returned.status_code, 200)
+        addrs = [client['addr'] for client in returned.json()['clients']]
+        self.assertIn('192.168.2.2', addrs)
+
+    def test_post(self):
+        returned = requests.post(self.url, headers=self.headers)
+        self.assertEqual(returned.status_code, 405)
+
+if __name__ == '__main__':
+    unittest.main()
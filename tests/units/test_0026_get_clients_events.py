@@ -0,0 +1,21 @@
+import requests
+import unittest
+
+class TestGetClientsEventsMethods(unittest.TestCase):
+
+    def setUp(self):
+        self.url = 'http://localhost:8888/clients/events'
+        self.headers = {'Authorization' : '07b3bfe728954619b58f0107ad73acc1'}
+
+    def test_get(self):
+        returned = requests.get(self.url, headers=self.headers, stream=True)
+        self.assertEqual(returned.status_code, 200)
+        self.assertEqual(returned.headers['Content-Type'], 'text/event-stream')
+        returned.close()
+
+    def test_post(self):
+        returned = requests.post(self.url, headers=self.headers)
+        self.assertEqual(returned.status_code, 405)
+
+if __name__ == '__main__':
+    unittest.main()